@@ -1,17 +1,41 @@
 /*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
 #include "pstree.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 
-static pstree_node_t *pstree_do_node(int pid, pstree_node_t *root);
+// The proper root of a tree also indexes every node by pid, so looking up a
+// process (and so linking each one to its parent while building) takes
+// constant time instead of a walk of the whole tree.
+typedef struct {
+    pstree_node_t   node;       // must be first
+    pstree_node_t **index;      // open addressing; NULL slots are free
+    int             index_mask;
+    int             count;
+    int             flags;
+} pstree_root_t;
+
+static pstree_node_t  *pstree_do_node(int pid, pstree_root_t *root);
+static pstree_node_t **index_slot(pstree_root_t *root, int pid);
+static void            index_insert(pstree_root_t *root, pstree_node_t *node);
+static void            pstree_free_node(pstree_node_t *node);
+static int             read_threads(int pid, const pstree_stat_t *st,
+                                    pstree_thread_t *out, int max);
+static int             read_stat(const char *path, int id, pstree_stat_t *st);
 
 pstree_node_t *pstree_create(void)
+{
+    return pstree_create_flags(0);
+}
+
+pstree_node_t *pstree_create_flags(int flags)
 {
     DIR *dirp = opendir("/proc");
     if (!dirp) {
@@ -21,10 +45,15 @@ pstree_node_t *pstree_create(void)
         return NULL;
     }
 
+    trace_begin("pstree_create");
+
     // manually allocate the root, since pstree_do_node won't like a NULL root
-    pstree_node_t *root = calloc(1, sizeof(*root));
-    root->pid = 0;
-    root->exec = calloc(1,1);
+    pstree_root_t *root = calloc(1, sizeof(*root));
+    root->node.pid  = 0;
+    root->node.exec = calloc(1,1);
+    root->index_mask = 1023;
+    root->index = calloc(root->index_mask + 1, sizeof(root->index[0]));
+    root->flags = flags;
 
     struct dirent *entry;
     while ((entry = readdir(dirp)) != NULL) {
@@ -38,114 +67,80 @@ pstree_node_t *pstree_create(void)
     }
 
     closedir(dirp);
-    return root;
+    trace_end();
+    return &root->node;
 }
 
-static pstree_node_t *pstree_do_node(int pid, pstree_node_t *root)
+static pstree_node_t *pstree_do_node(int pid, pstree_root_t *root)
 {
-    pstree_node_t *rv = NULL;
-    int fd = -1;
-    int readlen = 0;
-    int rv_allocated = 0;
-    char *readbuf = NULL;
-    char *openparen = NULL, *closeparen = NULL;
-    char *c;
-    char fnbuf[32];
-    char *sp = fnbuf;
-    
-    if (root == NULL || pid < 0)
-        return NULL;
+    if (pid <= 0)
+        return pid == 0 ? &root->node : NULL;
 
     // If the node already exists, return it. It would have been created in
     // response to seeing a child pid before the parent. 
-    // If the exec is not filled in yet, fill in the node as normal, but don't
-    // deallocate the node if reading /proc fails, otherwise the tree might
-    // have an invalid node in the middle somewhere.
-    if ((rv = pstree_find(root, pid)) != NULL && rv->exec)
+    pstree_node_t *rv = *index_slot(root, pid);
+    if (rv)
         return rv;
 
-    sp += sprintf(fnbuf, "/proc/%d/", pid);
-    strcpy(sp, "stat");
-    if ((fd = open(fnbuf, O_RDONLY)) < 0)
-        goto fail;
-
-    // The first 4 fields of the stat file are:
-    // 1. pid
-    // 2. executable name, in parens
-    // 3. status code (single char)
-    // 4. parent pid -- this is what we want
-    // All fields that follow are numeric.
-    // Unfortunately, the executable name may contain spaces or parens,
-    // so it is necessary to find the last instance of ')' in the file to
-    // properly find the 4th field. 
-
-    readbuf = malloc(1024);
-    readlen = 0;
-    while (1) {
-        int n = read(fd, readbuf + readlen, 1024);
-        if (n < 0)
-            goto fail;
-        if (n == 0)
-            break;
+    pstree_stat_t st;
+    if (!pstree_read_stat(pid, &st))
+        return NULL;
 
-        readlen += n;
-        readbuf = realloc(readbuf, 1024 + readlen);
-    }
+    // Only init hangs off pid 0; this leaves out kernel threads.
+    if (st.ppid < 0 || (st.ppid == 0 && pid != 1))
+        return NULL;
 
-    close(fd);
-    fd = -1;
-
-    openparen = strchr(readbuf, '(');
-    closeparen = strrchr(readbuf, ')');
-    if (!openparen || !closeparen || openparen > closeparen)
-        goto fail;
-    if (closeparen[1] != ' ')
-        goto fail;
-
-    if (!rv) {
-        rv_allocated = 1;
-        rv = calloc(1, sizeof(*rv));
-        rv->pid = pid;
-    }
-    rv->exec = malloc(closeparen - openparen);
-    strncpy(rv->exec, openparen+1, closeparen - openparen - 1);
-    rv->exec[closeparen - openparen - 1] = '\0';
+    pstree_node_t *parent = pstree_do_node(st.ppid, root);
+    if (parent == NULL)
+        return NULL;
 
-    {
-        errno = 0;
-        pstree_node_t *parentnode = NULL;
-        // ") X <pid> ..." + 4 = "<pid> ..."
-        int parentpid = strtol(closeparen+4, &c, 10);
-        if (parentpid < 0 || errno != 0 || *c != ' ')
-            goto fail;
-
-        if (parentpid == 0 && pid != 1)
-            goto fail;
-
-        parentnode = pstree_do_node(parentpid, root);
-        if (parentnode == NULL)
-            goto fail;
-
-        rv->parent = parentnode;
-        if (parentnode->child)
-            rv->sibling = parentnode->child;
-        parentnode->child = rv;
+    // Threads live right after the node, so they cost no extra allocation
+    // and are freed with it. Threads started since stat was read are
+    // missed, as are processes started since /proc was listed.
+    int max_threads = ((root->flags & PSTREE_THREADS) ? st.num_threads : 0);
+    rv = calloc(1, sizeof(*rv) + max_threads * sizeof(rv->threads[0]));
+    if (max_threads > 0) {
+        rv->threads     = (pstree_thread_t*)(rv + 1);
+        rv->num_threads = read_threads(pid, &st, rv->threads, max_threads);
     }
+    rv->pid     = pid;
+    rv->exec    = strdup(st.comm);
+    rv->parent  = parent;
+    rv->sibling = parent->child;
+    parent->child = rv;
 
-    free(readbuf);
+    index_insert(root, rv);
     return rv;
+}
+
+static pstree_node_t **index_slot(pstree_root_t *root, int pid)
+{
+    unsigned h = (unsigned)pid * 2654435761u;
+    while (1) {
+        pstree_node_t **slot = &root->index[h & root->index_mask];
+        if (!*slot || (*slot)->pid == pid)
+            return slot;
+        h++;
+    }
+}
 
-fail:
-    if (rv_allocated) {
-        if (rv->exec)
-            free(rv->exec);
-        free(rv);
+static void index_insert(pstree_root_t *root, pstree_node_t *node)
+{
+    // Keep the table at most half full.
+    if (2 * (root->count + 1) > root->index_mask + 1) {
+        pstree_node_t **old = root->index;
+        int old_size = root->index_mask + 1;
+
+        root->index_mask = 2 * old_size - 1;
+        root->index = calloc(2 * old_size, sizeof(root->index[0]));
+        for (int i = 0; i < old_size; i++)
+            if (old[i])
+                *index_slot(root, old[i]->pid) = old[i];
+        free(old);
     }
-    if (readbuf)
-        free(readbuf);
-    if (fd > -1)
-        close(fd);
-    return NULL;
+
+    *index_slot(root, node->pid) = node;
+    root->count++;
 }
 
 void pstree_free(pstree_node_t *root)
@@ -153,12 +148,18 @@ void pstree_free(pstree_node_t *root)
     if (root == NULL)
         return;
 
-    for (pstree_node_t *n = root->child, *next = NULL; n; n = next) {
+    free(((pstree_root_t*)root)->index);
+    pstree_free_node(root);
+}
+
+static void pstree_free_node(pstree_node_t *node)
+{
+    for (pstree_node_t *n = node->child, *next = NULL; n; n = next) {
         next = n->sibling;
-        pstree_free(n);
+        pstree_free_node(n);
     }
-    free(root->exec);
-    free(root);
+    free(node->exec);
+    free(node);
 }
 
 pstree_node_t *pstree_find(pstree_node_t *root, int pid)
@@ -166,6 +167,9 @@ pstree_node_t *pstree_find(pstree_node_t *root, int pid)
     if (root->pid == pid)
         return root;
 
+    if (root->parent == NULL)
+        return *index_slot((pstree_root_t*)root, pid);
+
     for (pstree_node_t *n = root->child; n; n = n->sibling) {
         pstree_node_t *rv = pstree_find(n, pid);
         if (rv) 
@@ -209,3 +213,166 @@ pstree_node_t *pstree_next_leaf(pstree_node_t *cur)
     
     return cur;
 }
+
+int pstree_read_exec(int pid, char *buf, int len)
+{
+    char fnbuf[32];
+    sprintf(fnbuf, "/proc/%d/comm", pid);
+
+    int fd = open(fnbuf, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    int n = read(fd, buf, len - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+
+    if (buf[n-1] == '\n')
+        n--;
+    buf[n] = '\0';
+    return 1;
+}
+
+int pstree_read_exe_name(int pid, char *buf, int len)
+{
+    char fnbuf[32], path[PATH_MAX];
+    sprintf(fnbuf, "/proc/%d/exe", pid);
+
+    int n = readlink(fnbuf, path, sizeof(path) - 1);
+    if (n <= 0)
+        return 0;
+    path[n] = '\0';
+
+    // An executable replaced since it started, as by an upgrade, reads
+    // back with a suffix.
+    static const char deleted[] = " (deleted)";
+    int d = sizeof(deleted) - 1;
+    if (n > d && strcmp(path + n - d, deleted) == 0)
+        path[n - d] = '\0';
+
+    const char *name = strrchr(path, '/');
+    snprintf(buf, len, "%s", name ? name + 1 : path);
+    return 1;
+}
+
+// The process's own stat describes its only thread, so only processes with
+// several threads need their task directory read.
+static int read_threads(int pid, const pstree_stat_t *st,
+                        pstree_thread_t *out, int max)
+{
+    if (max == 1) {
+        out[0].tid   = pid;
+        out[0].state = st->state;
+        out[0].utime = st->utime;
+        out[0].stime = st->stime;
+        return 1;
+    }
+
+    char path[32];
+    sprintf(path, "/proc/%d/task", pid);
+    DIR *dirp = opendir(path);
+    if (!dirp)
+        return 0;
+
+    int n = 0;
+    struct dirent *entry;
+    while (n < max && (entry = readdir(dirp)) != NULL) {
+        char *endp = NULL;
+        errno = 0;
+        int tid = strtol(entry->d_name, &endp, 10);
+        if (errno != 0 || !endp || endp[0] != '\0')
+            continue;
+
+        pstree_stat_t tst;
+        if (!pstree_read_task_stat(pid, tid, &tst))
+            continue;
+        out[n].tid   = tid;
+        out[n].state = tst.state;
+        out[n].utime = tst.utime;
+        out[n].stime = tst.stime;
+        n++;
+    }
+
+    closedir(dirp);
+    return n;
+}
+
+int pstree_read_stat(int pid, pstree_stat_t *st)
+{
+    char path[32];
+    sprintf(path, "/proc/%d/stat", pid);
+    return read_stat(path, pid, st);
+}
+
+int pstree_read_task_stat(int pid, int tid, pstree_stat_t *st)
+{
+    char path[48];
+    sprintf(path, "/proc/%d/task/%d/stat", pid, tid);
+    return read_stat(path, tid, st);
+}
+
+int pstree_ancestors(int pid, int *out, int max)
+{
+    int n = 0;
+    pstree_stat_t st;
+    while (pid > 0 && n < max) {
+        out[n++] = pid;
+        if (!pstree_read_stat(pid, &st))
+            break;
+        pid = st.ppid;
+    }
+    return n;
+}
+
+// id is the pid or tid the file describes.
+static int read_stat(const char *path, int id, pstree_stat_t *st)
+{
+    char buf[1024];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    int n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    // The name is in parens and may contain anything, including spaces and
+    // parens, so the fields after it are counted from the last ')'.
+    char *open_paren  = strchr(buf, '(');
+    char *close_paren = strrchr(buf, ')');
+    if (!open_paren || !close_paren || open_paren > close_paren ||
+            close_paren[1] != ' ' || !close_paren[2])
+        return 0;
+
+    int len = close_paren - open_paren - 1;
+    if (len >= sizeof(st->comm))
+        len = sizeof(st->comm) - 1;
+    memcpy(st->comm, open_paren + 1, len);
+    st->comm[len] = '\0';
+
+    st->pid   = id;
+    st->state = close_paren[2];
+
+    // Fields 4 through 24, of which we keep a few.
+    unsigned long long field[25];
+    char *c = close_paren + 3;
+    for (int i = 4; i <= 24; i++) {
+        char *end;
+        field[i] = strtoull(c, &end, 10);
+        if (end == c)
+            return 0;
+        c = end;
+    }
+
+    st->ppid        = field[4];
+    st->utime       = field[14];
+    st->stime       = field[15];
+    st->num_threads = field[20];
+    st->starttime   = field[22];
+    st->rss         = field[24];
+
+    return 1;
+}
@@ -2,12 +2,23 @@
 #ifndef PSTREE_H
 #define PSTREE_H
 
+// A thread of a process, from /proc/<pid>/task/<tid>/stat. Times are in
+// clock ticks.
+typedef struct {
+    int   tid;
+    char  state;
+    unsigned long long utime;
+    unsigned long long stime;
+} pstree_thread_t;
+
 typedef struct pstree_node_t {
     int   pid;      // pid of a process
     char *exec;     // path to the executable for this pid
     struct pstree_node_t *parent;   // Parent of pid (NULL for proper root)
     struct pstree_node_t *child;    // First child of pid (beware races)
     struct pstree_node_t *sibling;  // Next child
+    pstree_thread_t *threads;       // Only with PSTREE_THREADS, else NULL
+    int   num_threads;
 } pstree_node_t;
 
 // Create a tree of all processes.
@@ -17,15 +28,58 @@ typedef struct pstree_node_t {
 // the /proc tree cannot be read atomically.
 pstree_node_t *pstree_create(void);
 
+// Like pstree_create, with options. PSTREE_THREADS also lists the threads of
+// each process, in the same allocation as its node. Single-threaded
+// processes cost nothing extra, since the process's own stat describes its
+// only thread.
+#define PSTREE_THREADS 0x01
+pstree_node_t *pstree_create_flags(int flags);
+
 // Free memory associated with a process tree. Always pass the proper root of
 // the tree, not a subtree.
 void pstree_free(pstree_node_t *root);
 
-// Locate a root node within the given tree or subtree. 
+// Locate a root node within the given tree or subtree. Given the proper
+// root, this is a constant-time index lookup.
 pstree_node_t *pstree_find(pstree_node_t *root, int pid);
 
 // Find the next leaf node by depth-first traversal. Pass in root to get the
 // first leaf node.
 pstree_node_t *pstree_next_leaf(pstree_node_t *cur);
 
+// Read the executable name of a single pid into buf, without building a
+// tree. Returns 0 if the process is gone.
+int pstree_read_exec(int pid, char *buf, int len);
+
+// Read the file name of a pid's executable from its /proc/<pid>/exe link,
+// which unlike the name above isn't cut short at 15 characters. Returns 0
+// if the link can't be read.
+int pstree_read_exe_name(int pid, char *buf, int len);
+
+// Fields of /proc/<pid>/stat. Times are in clock ticks; starttime counts
+// from boot and, together with the pid, identifies a process across pid
+// reuse.
+typedef struct {
+    int   pid;
+    int   ppid;
+    char  state;
+    char  comm[16];
+    int   num_threads;
+    unsigned long long utime;
+    unsigned long long stime;
+    unsigned long long starttime;
+    unsigned long      rss;       // pages
+} pstree_stat_t;
+
+// Parse /proc/<pid>/stat with one read into a stack buffer and no
+// allocation. Returns 0 if the process is gone or the file is malformed.
+int pstree_read_stat(int pid, pstree_stat_t *st);
+
+// The same for one thread of a process, from /proc/<pid>/task/<tid>/stat.
+int pstree_read_task_stat(int pid, int tid, pstree_stat_t *st);
+
+// Copy up to max of pid and its ancestors into out, nearest first, following
+// parent pids in /proc. Returns how many were copied.
+int pstree_ancestors(int pid, int *out, int max);
+
 #endif
@@ -0,0 +1,81 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "ringq.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+int ringq_init(ringq_t *q, size_t size)
+{
+    size_t n = 2;
+    while (n < size)
+        n <<= 1;
+
+    q->cells = malloc(n * sizeof(q->cells[0]));
+    if (!q->cells)
+        return 0;
+
+    for (size_t i = 0; i < n; i++) {
+        q->cells[i].seq  = i;
+        q->cells[i].data = NULL;
+    }
+    q->mask = n - 1;
+    q->head = 0;
+    q->tail = 0;
+
+    return 1;
+}
+
+void ringq_destroy(ringq_t *q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
+
+int ringq_push(ringq_t *q, void *item)
+{
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    while (1) {
+        ringq_cell_t *cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // Slot is free for this lap; claim it.
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->data = item;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+            // pos was reloaded by the failed exchange
+        } else if (diff < 0) {
+            // Slot still holds an item from the previous lap.
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void *ringq_pop(ringq_t *q)
+{
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (1) {
+        ringq_cell_t *cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                void *item = cell->data;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1,
+                        __ATOMIC_RELEASE);
+                return item;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
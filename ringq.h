@@ -0,0 +1,39 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef RINGQ_H
+#define RINGQ_H
+
+#include <stddef.h>
+
+// Bounded lock-free queue of pointers. Each slot carries a sequence number
+// that tells producers and consumers whether it is free or filled for the
+// current lap, so any number of threads may push and pop concurrently; in
+// practice it is used as SPSC or MPSC. Neither operation ever blocks: push
+// fails when the queue is full and pop returns NULL when it is empty, and
+// callers arrange their own wakeups.
+
+typedef struct {
+    size_t seq;
+    void  *data;
+} ringq_cell_t;
+
+typedef struct {
+    ringq_cell_t *cells;
+    size_t        mask;
+    char          pad0[64];
+    size_t        head;   // next slot to push
+    char          pad1[64];
+    size_t        tail;   // next slot to pop
+    char          pad2[64];
+} ringq_t;
+
+// Size is rounded up to a power of two. Returns 0 on allocation failure.
+int ringq_init(ringq_t *q, size_t size);
+void ringq_destroy(ringq_t *q);
+
+// Returns 0 if the queue is full. Pushing NULL is not allowed.
+int ringq_push(ringq_t *q, void *item);
+
+// Returns NULL if the queue is empty.
+void *ringq_pop(ringq_t *q);
+
+#endif
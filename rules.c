@@ -0,0 +1,181 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "rules.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#define NO_RULE INT32_MAX
+
+typedef struct {
+    int   field;
+    char *pattern;  // lowercased
+    char *desktop;
+} rule_t;
+
+static rule_t *rules       = NULL;
+static int     num_rules   = 0;
+static int     rules_alloc = 0;
+
+// The compiled automaton. Bytes are first mapped to a class; every byte that
+// appears in no pattern shares class 0, which keeps the transition table
+// small. delta[node * num_classes + class] is the next node, with failure
+// transitions already folded in, and best[node * RULE_FIELDS + field] is the
+// lowest-numbered rule for that field ending at or suffix-linked from node.
+static uint8_t  classes[256];
+static int      num_classes = 0;
+static int32_t *delta       = NULL;
+static int32_t *best        = NULL;
+static int      num_nodes   = 0;
+static int      compiled    = 0;
+
+int rules_field(const char *name)
+{
+    if (strcmp(name, "class") == 0)
+        return RULE_CLASS;
+    if (strcmp(name, "title") == 0)
+        return RULE_TITLE;
+    if (strcmp(name, "exec") == 0)
+        return RULE_EXEC;
+    return -1;
+}
+
+int rules_add(int field, const char *pattern, const char *desktop)
+{
+    if (field < 0 || field >= RULE_FIELDS || !pattern[0])
+        return 0;
+
+    if (num_rules == rules_alloc) {
+        rules_alloc = (rules_alloc ? 2 * rules_alloc : 16);
+        rules = realloc(rules, rules_alloc * sizeof(rules[0]));
+    }
+
+    rule_t *r = &rules[num_rules++];
+    r->field   = field;
+    r->pattern = strdup(pattern);
+    r->desktop = strdup(desktop);
+    for (char *c = r->pattern; *c; c++)
+        *c = tolower((unsigned char)*c);
+
+    return 1;
+}
+
+int rules_compile(void)
+{
+    free(delta);
+    free(best);
+    delta = best = NULL;
+    compiled = 0;
+
+    // Assign alphabet classes. Upper case bytes share their lower case
+    // class so input needs no folding.
+    memset(classes, 0, sizeof(classes));
+    num_classes = 1;
+    size_t max_nodes = 1;
+    for (int i = 0; i < num_rules; i++) {
+        for (unsigned char *c = (unsigned char*)rules[i].pattern; *c; c++) {
+            if (!classes[*c]) {
+                classes[*c] = num_classes;
+                classes[toupper(*c)] = num_classes;
+                num_classes++;
+            }
+            max_nodes++;
+        }
+    }
+
+    delta = malloc(max_nodes * num_classes * sizeof(delta[0]));
+    best  = malloc(max_nodes * RULE_FIELDS * sizeof(best[0]));
+    int32_t *fail  = malloc(max_nodes * sizeof(fail[0]));
+    int32_t *queue = malloc(max_nodes * sizeof(queue[0]));
+    if (!delta || !best || !fail || !queue) {
+        free(fail);
+        free(queue);
+        return 0;
+    }
+
+    for (size_t i = 0; i < max_nodes * num_classes; i++)
+        delta[i] = -1;
+    for (size_t i = 0; i < max_nodes * RULE_FIELDS; i++)
+        best[i] = NO_RULE;
+
+    // Build the trie.
+    num_nodes = 1;
+    for (int i = 0; i < num_rules; i++) {
+        int32_t node = 0;
+        for (unsigned char *c = (unsigned char*)rules[i].pattern; *c; c++) {
+            int32_t *next = &delta[node * num_classes + classes[*c]];
+            if (*next < 0)
+                *next = num_nodes++;
+            node = *next;
+        }
+        int32_t *b = &best[node * RULE_FIELDS + rules[i].field];
+        if (i < *b)
+            *b = i;
+    }
+
+    // Breadth-first pass: compute failure links, fold them into the
+    // transition table, and inherit matches from the failure node, which
+    // is always shallower and so already complete.
+    int head = 0, tail = 0;
+    for (int a = 0; a < num_classes; a++) {
+        int32_t v = delta[a];
+        if (v < 0) {
+            delta[a] = 0;
+        } else {
+            fail[v] = 0;
+            queue[tail++] = v;
+        }
+    }
+
+    while (head < tail) {
+        int32_t u = queue[head++];
+        for (int f = 0; f < RULE_FIELDS; f++) {
+            int32_t inherited = best[fail[u] * RULE_FIELDS + f];
+            if (inherited < best[u * RULE_FIELDS + f])
+                best[u * RULE_FIELDS + f] = inherited;
+        }
+
+        for (int a = 0; a < num_classes; a++) {
+            int32_t *v = &delta[u * num_classes + a];
+            int32_t  f = delta[fail[u] * num_classes + a];
+            if (*v < 0) {
+                *v = f;
+            } else {
+                fail[*v] = f;
+                queue[tail++] = *v;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+    compiled = num_rules;
+    return 1;
+}
+
+int rules_count(void)
+{
+    return compiled;
+}
+
+const char *rules_match(const char *fields[RULE_FIELDS])
+{
+    if (!compiled)
+        return NULL;
+
+    int32_t win = NO_RULE;
+    for (int f = 0; f < RULE_FIELDS; f++) {
+        if (!fields[f])
+            continue;
+
+        int32_t node = 0;
+        const unsigned char *c = (const unsigned char*)fields[f];
+        for (; *c; c++) {
+            node = delta[node * num_classes + classes[*c]];
+            if (best[node * RULE_FIELDS + f] < win)
+                win = best[node * RULE_FIELDS + f];
+        }
+    }
+
+    return win == NO_RULE ? NULL : rules[win].desktop;
+}
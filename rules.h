@@ -0,0 +1,35 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef RULES_H
+#define RULES_H
+
+// Window placement rules: "windows whose <field> contains <pattern> go to the
+// desktop named <desktop>". Patterns are case-insensitive substrings.
+//
+// All patterns are compiled into one Aho-Corasick automaton with a
+// reduced alphabet, so checking a window costs time proportional to the
+// length of its strings, not to the number of rules. When several rules
+// match, the one added first wins.
+
+#define RULE_CLASS  0   // WM_CLASS instance or class name
+#define RULE_TITLE  1   // _NET_WM_NAME, or WM_NAME
+#define RULE_EXEC   2   // executable name of the owning process
+#define RULE_FIELDS 3
+
+// Returns the RULE_* field for a name like "class", or -1.
+int rules_field(const char *name);
+
+// Add a rule. Rules added after rules_compile take effect at the next
+// compile. Returns 0 on error.
+int rules_add(int field, const char *pattern, const char *desktop);
+
+// Build the matcher. Returns 0 on allocation failure.
+int rules_compile(void);
+
+// Number of rules in the compiled matcher.
+int rules_count(void);
+
+// Match a window's strings, indexed by RULE_* field; NULL entries are
+// skipped. Returns the target desktop name of the winning rule, or NULL.
+const char *rules_match(const char *fields[RULE_FIELDS]);
+
+#endif
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Build and run the unit tests. They need no X server, and the cgroup test
+# works on a plain directory standing in for cgroupfs.
+set -e
+cd "$(dirname "$0")/.."
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+cc="${CC:-gcc} -std=gnu99 -Wall -pthread -I."
+
+$cc -o "$out/test_cgroup" tests/test_cgroup.c vtabs_cgroup.c pstree.c trace.c
+$cc -o "$out/test_ringq" tests/test_ringq.c ringq.c
+$cc -o "$out/test_rules" tests/test_rules.c rules.c
+$cc -o "$out/test_words" tests/test_words.c words.c
+
+for t in "$out"/test_*; do
+    "$t"
+done
@@ -0,0 +1,31 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+// Minimal checks for the unit tests in this directory. A failed check is
+// reported and counted, and the test carries on; main returns test_done().
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                     \
+                    __FILE__, __LINE__, #cond);                              \
+            test_failures++;                                                 \
+        }                                                                    \
+    } while (0)
+
+static int test_done(const char *name)
+{
+    if (test_failures) {
+        fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif
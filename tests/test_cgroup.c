@@ -0,0 +1,136 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "test.h"
+#include "vtabs_cgroup.h"
+#include "vtabs_x11.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// cgroup_write appends to cgroup.procs and truncates settings, so a plain
+// directory ends up holding exactly what the kernel would have been told.
+
+int verbose = 0;
+FILE *cmd_out, *cmd_err;
+
+// Stand-ins for the window mirror.
+int x11_num_desktops = 3;
+int x11_active_desktop = 0;
+
+static x11_owner_t owners[4];
+static int         num_owners = 0;
+
+int x11_get_owners(const x11_owner_t **out)
+{
+    *out = owners;
+    return num_owners;
+}
+
+const x11_owner_t *x11_find_owner(int pid)
+{
+    for (int i = 0; i < num_owners; i++) {
+        if (owners[i].pid == pid)
+            return &owners[i];
+    }
+    return NULL;
+}
+
+static char base[64];
+
+// Contents of a file under base, or "" if it doesn't exist.
+static const char *slurp(const char *file)
+{
+    static char buf[256];
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", base, file);
+
+    buf[0] = '\0';
+    FILE *f = fopen(path, "r");
+    if (f) {
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        buf[n] = '\0';
+        fclose(f);
+    }
+    return buf;
+}
+
+static void put(const char *file, const char *value)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", base, file);
+    FILE *f = fopen(path, "w");
+    fputs(value, f);
+    fclose(f);
+}
+
+int main(void)
+{
+    cmd_out = stdout;
+    cmd_err = stderr;
+
+    snprintf(base, sizeof(base), "/tmp/vtabs-test-XXXXXX");
+    if (!mkdtemp(base)) {
+        perror(base);
+        return 1;
+    }
+
+    // A leaf a killed daemon left frozen is thawed on open.
+    char path[128];
+    snprintf(path, sizeof(path), "%s/desk5", base);
+    mkdir(path, 0755);
+    put("desk5/cgroup.freeze", "1");
+
+    CHECK(cgroup_open(base, 1));
+    CHECK(strcmp(slurp("cgroup.subtree_control"), "+cpu") == 0);
+    CHECK(strcmp(slurp("desk5/cgroup.freeze"), "0") == 0);
+
+    // Sorted by pid, as x11_get_owners returns them. The pids don't have
+    // to exist, since without a tree only the owners themselves move.
+    char self[16];
+    snprintf(self, sizeof(self), "%d\n", (int)getpid());
+    owners[0] = (x11_owner_t){ .pid = getpid(), .desktop = 2 };
+    owners[1] = (x11_owner_t){ .pid = 99999901, .desktop = 1 };
+    owners[2] = (x11_owner_t){ .pid = 99999902, .desktop = -1 };
+    num_owners = 3;
+
+    // Placement: each owner in its desktop's leaf, sticky or split ones in
+    // shared, and never ourselves.
+    cgroup_activate(0);
+    cgroup_update(NULL, 1);
+    CHECK(strcmp(slurp("desk1/cgroup.procs"), "99999901\n") == 0);
+    CHECK(strcmp(slurp("shared/cgroup.procs"), "99999902\n") == 0);
+    CHECK(strstr(slurp("desk2/cgroup.procs"), self) == NULL);
+
+    // Nothing moves again until windows change.
+    cgroup_update(NULL, 0);
+    CHECK(strcmp(slurp("desk1/cgroup.procs"), "99999901\n") == 0);
+
+    // Weight and freeze: idle desktops are weighted down and frozen, the
+    // shared leaf keeps the default and is never frozen.
+    CHECK(strcmp(slurp("desk1/cpu.weight"), "25") == 0);
+    CHECK(strcmp(slurp("desk1/cgroup.freeze"), "1") == 0);
+    CHECK(strcmp(slurp("shared/cpu.weight"), "100") == 0);
+    CHECK(strcmp(slurp("shared/cgroup.freeze"), "0") == 0);
+
+    cgroup_activate(1);
+    CHECK(strcmp(slurp("desk1/cpu.weight"), "1000") == 0);
+    CHECK(strcmp(slurp("desk1/cgroup.freeze"), "0") == 0);
+
+    // Moving desktops takes the owner along.
+    owners[1].desktop = 2;
+    cgroup_update(NULL, 1);
+    CHECK(strcmp(slurp("desk2/cgroup.procs"), "99999901\n") == 0);
+    CHECK(strcmp(slurp("desk2/cgroup.freeze"), "1") == 0);
+
+    // Stopping thaws everything.
+    cgroup_close();
+    CHECK(strcmp(slurp("desk2/cgroup.freeze"), "0") == 0);
+    CHECK(strcmp(slurp("desk1/cgroup.freeze"), "0") == 0);
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", base);
+    if (system(cmd) != 0)
+        fprintf(stderr, "Failed to remove %s\n", base);
+
+    return test_done("test_cgroup");
+}
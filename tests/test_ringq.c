@@ -0,0 +1,83 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "test.h"
+#include "ringq.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define STRESS_ITEMS 50000
+
+static ringq_t stress;
+
+// Each producer pushes 1 to STRESS_ITEMS, encoded with its own tag bit.
+static void *producer_main(void *arg)
+{
+    uintptr_t tag = (uintptr_t)arg;
+    for (uintptr_t i = 1; i <= STRESS_ITEMS; i++) {
+        while (!ringq_push(&stress, (void*)(i << 1 | tag)))
+            sched_yield();
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    ringq_t q;
+    int items[16];
+
+    // Sizes round up to a power of two.
+    CHECK(ringq_init(&q, 3));
+    CHECK(q.mask == 3);
+
+    // Empty, then full, then empty again.
+    CHECK(ringq_pop(&q) == NULL);
+    for (int i = 0; i < 4; i++)
+        CHECK(ringq_push(&q, &items[i]));
+    CHECK(!ringq_push(&q, &items[4]));
+    for (int i = 0; i < 4; i++)
+        CHECK(ringq_pop(&q) == &items[i]);
+    CHECK(ringq_pop(&q) == NULL);
+
+    // Many laps around the ring, at every fill level, stay in order.
+    int next_in = 0, next_out = 0;
+    for (int lap = 0; lap < 100; lap++) {
+        int fill = lap % 5;
+        for (int i = 0; i < fill; i++, next_in++)
+            CHECK(ringq_push(&q, &items[next_in % 16]));
+        if (fill == 4)
+            CHECK(!ringq_push(&q, &items[0]));
+        for (int i = 0; i < fill; i++, next_out++)
+            CHECK(ringq_pop(&q) == &items[next_out % 16]);
+        CHECK(ringq_pop(&q) == NULL);
+    }
+    ringq_destroy(&q);
+
+    // Two producers and one consumer: nothing is lost or duplicated, and
+    // each producer's items arrive in the order they were pushed.
+    CHECK(ringq_init(&stress, 64));
+    pthread_t a, b;
+    pthread_create(&a, NULL, producer_main, (void*)0);
+    pthread_create(&b, NULL, producer_main, (void*)1);
+
+    uintptr_t last[2] = { 0, 0 };
+    int in_order = 1;
+    for (int got = 0; got < 2 * STRESS_ITEMS;) {
+        void *item = ringq_pop(&stress);
+        if (!item) {
+            sched_yield();
+            continue;
+        }
+        uintptr_t v = (uintptr_t)item;
+        in_order &= ((v >> 1) == last[v & 1] + 1);
+        last[v & 1] = v >> 1;
+        got++;
+    }
+    pthread_join(a, NULL);
+    pthread_join(b, NULL);
+    CHECK(in_order);
+    CHECK(last[0] == STRESS_ITEMS && last[1] == STRESS_ITEMS);
+    CHECK(ringq_pop(&stress) == NULL);
+    ringq_destroy(&stress);
+
+    return test_done("test_ringq");
+}
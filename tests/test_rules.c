@@ -0,0 +1,76 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "test.h"
+#include "rules.h"
+#include <string.h>
+
+// Match a window with the given class, title and executable (any may be
+// NULL), and compare the winning desktop with want, which may be NULL.
+static int matches(const char *class, const char *title, const char *exec,
+                   const char *want)
+{
+    const char *fields[RULE_FIELDS] = { NULL };
+    fields[RULE_CLASS] = class;
+    fields[RULE_TITLE] = title;
+    fields[RULE_EXEC]  = exec;
+
+    const char *got = rules_match(fields);
+    if (!got || !want)
+        return got == want;
+    return strcmp(got, want) == 0;
+}
+
+int main(void)
+{
+    CHECK(rules_field("class") == RULE_CLASS);
+    CHECK(rules_field("title") == RULE_TITLE);
+    CHECK(rules_field("exec") == RULE_EXEC);
+    CHECK(rules_field("name") == -1);
+
+    CHECK(!rules_add(RULE_CLASS, "", "empty"));
+    CHECK(!rules_add(RULE_FIELDS, "x", "bad field"));
+
+    // Nothing matches before the first compile.
+    CHECK(rules_add(RULE_TITLE, "hers", "hers"));
+    CHECK(rules_count() == 0);
+    CHECK(matches(NULL, "hers", NULL, NULL));
+
+    // The classic overlapping set: "ushers" contains she, he and hers, and
+    // the earliest added of those wins wherever it ends.
+    CHECK(rules_add(RULE_TITLE, "she", "she"));
+    CHECK(rules_add(RULE_TITLE, "he", "he"));
+    CHECK(rules_add(RULE_TITLE, "his", "his"));
+    CHECK(rules_compile());
+    CHECK(rules_count() == 4);
+    CHECK(matches(NULL, "ushers", NULL, "hers"));
+    CHECK(matches(NULL, "ushe", NULL, "she"));
+    CHECK(matches(NULL, "the", NULL, "he"));
+    CHECK(matches(NULL, "this", NULL, "his"));
+    CHECK(matches(NULL, "xhisx", NULL, "his"));
+    CHECK(matches(NULL, "hi", NULL, NULL));
+    CHECK(matches(NULL, "", NULL, NULL));
+
+    // Case doesn't matter, on either side.
+    CHECK(rules_add(RULE_CLASS, "FireFox", "web"));
+    CHECK(rules_compile());
+    CHECK(matches("navigator\nfirefox", NULL, NULL, "web"));
+    CHECK(matches("FIREFOX", NULL, NULL, "web"));
+
+    // Patterns only match their own field.
+    CHECK(matches(NULL, "firefox", NULL, NULL));
+    CHECK(matches("usher", NULL, NULL, NULL));
+
+    // Across fields, the earliest added rule still wins.
+    CHECK(rules_add(RULE_EXEC, "vim", "edit"));
+    CHECK(rules_add(RULE_EXEC, "im", "later"));
+    CHECK(rules_compile());
+    CHECK(matches("firefox", "she", "vim", "she"));
+    CHECK(matches("firefox", NULL, "vim", "web"));
+    CHECK(matches(NULL, NULL, "nvim", "edit"));
+    CHECK(matches(NULL, NULL, "im", "later"));
+
+    // Bytes outside every pattern, including high ones, just reset.
+    CHECK(matches(NULL, "\xe2\x80\x94she\xff", NULL, "she"));
+    CHECK(matches(NULL, "s-h-e", NULL, NULL));
+
+    return test_done("test_rules");
+}
@@ -0,0 +1,75 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "test.h"
+#include "words.h"
+#include <stdarg.h>
+#include <string.h>
+
+// Split a copy of line, and compare the result with count and the count
+// words that follow it.
+static int splits(const char *line, int max, int count, ...)
+{
+    char buf[256];
+    char *words[16];
+    strcpy(buf, line);
+
+    int n = split_words(buf, words, max);
+    if (n != count)
+        return 0;
+    if (n < 0)
+        return 1;
+
+    const char *want[16];
+    va_list ap;
+    va_start(ap, count);
+    for (int i = 0; i < count; i++)
+        want[i] = va_arg(ap, const char*);
+    va_end(ap);
+
+    for (int i = 0; i < n; i++) {
+        if (strcmp(words[i], want[i]) != 0)
+            return 0;
+    }
+    return words[n] == NULL;
+}
+
+int main(void)
+{
+    // Whitespace of every kind separates words, and blank lines are empty.
+    CHECK(splits("", 8, 0));
+    CHECK(splits(" \t\r\n", 8, 0));
+    CHECK(splits("switch -r 1", 8, 3, "switch", "-r", "1"));
+    CHECK(splits("  move\t-i 2  -t 3\r\n", 8, 5, "move", "-i", "2", "-t", "3"));
+
+    // Comments start only where a word could.
+    CHECK(splits("# all comment", 8, 0));
+    CHECK(splits("add # the rest", 8, 1, "add"));
+    CHECK(splits("rename -n a#b", 8, 3, "rename", "-n", "a#b"));
+    CHECK(splits("rename -n '#1'", 8, 3, "rename", "-n", "#1"));
+
+    // Quotes group words, and join with whatever touches them.
+    CHECK(splits("add -n 'web stuff'", 8, 3, "add", "-n", "web stuff"));
+    CHECK(splits("add -n \"web stuff\"", 8, 3, "add", "-n", "web stuff"));
+    CHECK(splits("a'b c'd e", 8, 2, "ab cd", "e"));
+    CHECK(splits("'' x", 8, 2, "", "x"));
+    CHECK(splits("\"a\" b", 8, 2, "a", "b"));
+    CHECK(splits("'a'\"b\"", 8, 1, "ab"));
+
+    // Backslash escapes outside quotes and inside "", but not inside ''.
+    CHECK(splits("a\\ b", 8, 1, "a b"));
+    CHECK(splits("\"a\\\"b\"", 8, 1, "a\"b"));
+    CHECK(splits("'a\\' b", 8, 2, "a\\", "b"));
+    CHECK(splits("\\'x", 8, 1, "'x"));
+    CHECK(splits("\\#x", 8, 1, "#x"));
+    CHECK(splits("a\\", 8, 1, "a\\"));
+
+    // Malformed lines.
+    CHECK(splits("add -n 'web", 8, -1));
+    CHECK(splits("add -n \"web\\\"", 8, -1));
+
+    // The word limit.
+    CHECK(splits("a b c", 3, 3, "a", "b", "c"));
+    CHECK(splits("a b c", 2, -1));
+    CHECK(splits("a b  # c", 2, 2, "a", "b"));
+
+    return test_done("test_words");
+}
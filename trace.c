@@ -0,0 +1,120 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define TRACE_MAX_DEPTH 32
+
+static FILE           *trace_file = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long       trace_epoch = 0;
+
+// Open spans on this thread. Spans nested deeper than the stack are
+// counted but not recorded.
+static __thread struct {
+    const char *name;
+    long long   start;
+} stack[TRACE_MAX_DEPTH];
+static __thread int depth = 0;
+static __thread int tid   = 0;
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void trace_close(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    fputs("\n]\n", trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int trace_open(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+
+    // The closing bracket is optional to trace viewers, so a trace cut
+    // short by a signal still loads.
+    fputs("[\n", f);
+    trace_epoch = now_us();
+    trace_file = f;
+    atexit(trace_close);
+
+    return 1;
+}
+
+void trace_begin(const char *name)
+{
+    if (!trace_file)
+        return;
+
+    if (depth < TRACE_MAX_DEPTH) {
+        stack[depth].name  = name;
+        stack[depth].start = now_us();
+    }
+    depth++;
+}
+
+void trace_end(void)
+{
+    if (!trace_file || depth == 0)
+        return;
+
+    if (--depth >= TRACE_MAX_DEPTH)
+        return;
+
+    long long end = now_us();
+    if (!tid)
+        tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        static int first = 1;
+        fputs(first ? "{\"name\":\"" : ",\n{\"name\":\"", trace_file);
+        first = 0;
+
+        // Names are usually literals, but command names come from the user.
+        for (const unsigned char *c = (const unsigned char*)stack[depth].name;
+                *c; c++) {
+            if (*c == '"' || *c == '\\' || *c < 0x20)
+                fprintf(trace_file, "\\u%04x", *c);
+            else
+                fputc(*c, trace_file);
+        }
+
+        fprintf(trace_file,
+                "\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                "\"pid\":%d,\"tid\":%d}",
+                stack[depth].start - trace_epoch, end - stack[depth].start,
+                (int)getpid(), tid);
+
+        // Flush whole top-level spans so a killed process loses little.
+        if (depth == 0)
+            fflush(trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int trace_mark(void)
+{
+    return depth;
+}
+
+void trace_unwind(int mark)
+{
+    while (trace_file && depth > mark)
+        trace_end();
+}
@@ -0,0 +1,23 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef TRACE_H
+#define TRACE_H
+
+// Timing spans written in Chrome's trace-event JSON format, for viewing in
+// Perfetto or about:tracing. Spans nest per thread and are written as they
+// complete, so a daemon that gets killed still leaves a usable trace.
+// While tracing is off, begin/end cost a single branch.
+
+// Start writing spans to path. Returns 0 if the file can't be opened.
+int trace_open(const char *path);
+
+// Open a span on the calling thread. The name must stay valid until the
+// matching trace_end.
+void trace_begin(const char *name);
+void trace_end(void);
+
+// For code that unwinds with longjmp: trace_mark returns the current nesting
+// depth, and trace_unwind ends any spans opened since.
+int  trace_mark(void);
+void trace_unwind(int mark);
+
+#endif
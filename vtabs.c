@@ -2,26 +2,60 @@
 
 #include "pstree.h"
 #include "vtabs_x11.h"
+#include "vtabs_shm.h"
+#include "vtabs_daemon.h"
+#include "vtabs_cache.h"
+#include "vtabs_stats.h"
+#include "trace.h"
+#include "rules.h"
+#include "words.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdarg.h>
+#include <setjmp.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
 
 #define INT_UNSET 0x80000000
 
+// Without the daemon's tree, stats -w rescans processes at least this often.
+#define STATS_TREE_MS 5000
+
 static char *my_name = NULL;
 
+// Where commands write: stdout and stderr, except that the daemon points
+// them at the client's terminal while it runs a command for it. The
+// process's own streams are left alone for its other threads.
+FILE *cmd_out = NULL;
+FILE *cmd_err = NULL;
+
+// When set, a failing command unwinds to here instead of exiting, so that
+// one bad command doesn't take down a long-running process.
+static jmp_buf *fail_env = NULL;
+
+static void fail(void)
+{
+    if (fail_env)
+        longjmp(*fail_env, 1);
+    exit(1);
+}
+
 static void usage(const char *fmt, ...) 
 {
     if (fmt) {
         va_list ap;
         va_start(ap, fmt);
-        vfprintf(stderr, fmt, ap);
+        vfprintf(cmd_err, fmt, ap);
         va_end(ap);
-        fputc('\n', stderr);
+        fputc('\n', cmd_err);
     }
 
+    if (fail_env)
+        fail();
+
 #define USAGE \
 "Usage: %s [<options>] <command> [<command> ...]\n\n"                          \
 "Commands:\n"                                                                  \
@@ -56,22 +90,73 @@ static void usage(const char *fmt, ...)
 "\n"                                                                           \
 "  clear [-i <index>]\n"                                                       \
 "    Attempt to close windows on a desktop.\n"                                 \
-"    -i: specify the desktop whose windows are to be closed\n"                 \
+"    -i: specify the desktop to clear (default: active desktop)\n"             \
+"\n"                                                                           \
+"  daemon [-y] [-w <ms>] [-g <cgroup> [-F]] [-R <s>]\n"                        \
+"    Keep running, tracking desktop state and serving commands sent by -c.\n"  \
+"    -y: dynamic desktops; remove empty desktops other than the active one\n"  \
+"        and keep exactly one empty desktop at the end\n"                      \
+"    -w: merge relative switches arriving within this many ms into one\n"      \
+"        (default: 40; 0 sends every switch)\n"                                \
+"    -g: move each desktop's processes into a leaf of this delegated cgroup\n" \
+"        v2 directory, and give the active desktop's leaf more CPU weight\n"   \
+"    -F: with -g, freeze the leaves of inactive desktops instead\n"            \
+"    -R: page out the anonymous memory of desktops idle for this many\n"       \
+"        seconds (needs Linux 5.10 and CAP_SYS_NICE)\n"                        \
+"\n"                                                                           \
+"  list [-i <index> | -s] [-p <pid>] [-e <name>] [-t | -j]\n"                  \
+"    List windows with their desktop, pid and executable name.\n"              \
+"    -i: only list windows on the given desktop\n"                             \
+"    -s: only list sticky windows (shown on all desktops)\n"                   \
+"    -p: only list windows of the given process and its descendants\n"         \
+"    -e: only list windows whose executable has exactly this name\n"           \
+"    -t: print tab-separated values instead of aligned columns\n"              \
+"    -j: print a JSON array with one object per window\n"                      \
+"\n"                                                                           \
+"  stats [-w <ms>] [-T] [-j]\n"                                                \
+"    Show memory and CPU use per desktop, counting each process toward the\n"  \
+"    desktop of the nearest window-owning process above it, or itself.\n"      \
+"    Processes with windows on several desktops, or sticky windows, count\n"   \
+"    toward a shared group.\n"                                                 \
+"    -w: keep sampling every this many ms, with CPU use since the last\n"      \
+"        sample (command line only)\n"                                         \
+"    -T: also list threads, to count those that are runnable (not with -c)\n"  \
+"    -j: print one line of JSON per sample instead of a table\n"               \
+"\n"                                                                           \
+"  sync\n"                                                                     \
+"    Wait until the window manager has acted on everything sent so far.\n"     \
+"\n"                                                                           \
+"  subscribe [-w <ms>]\n"                                                      \
+"    Print a line of JSON describing the desktops each time they change.\n"    \
+"    -w: coalesce changes arriving within this many ms (default: 50)\n"        \
 "\n"                                                                           \
 "Options:\n"                                                                   \
 "    -v: verbose mode\n"                                                       \
 "    -p: preview mode (verbose, but don't take any action)\n"                  \
-"    -f: specify path to vtabsrc (default: ~/.config/vtabsrc)\n"               \
+"    -f: specify path to vtabsrc (default: ~/.config/vtabsrc). Lines of\n"     \
+"        rule (class|title|exec) <pattern> <desktop name>\n"                   \
+"        send new windows to a desktop while running daemon or subscribe\n"    \
+"    -m: publish desktop state to the named shared memory segment\n"           \
+"    -c: send commands to a running daemon, if there is one\n"                 \
+"    -T: write Chrome trace-event timings to the given file\n"                 \
+"    -b: read commands one line at a time from a file (or - for stdin),\n"     \
+"        syncing only at sync commands and at the end of input\n"              \
+"    -w: wait this many ms for the window manager to act on changes\n"         \
+"        before reporting them as failed (default: 1000)\n"                    \
 "\n"
 
-    fprintf(stderr, USAGE, my_name);
+    fprintf(cmd_err, USAGE, my_name);
     exit(1);
 }
 
 static Display *dpy  = NULL;
 static Window   root = None;
 
-static char *rcfile = "~/config/vtabsrc";
+static char *rcfile = "~/.config/vtabsrc";
+static char *shmname = NULL;
+static char *tracefile = NULL;
+static char *batchfile = NULL;
+static int   confirm_ms = 1000;
 
 // TODO: might be better to error out on invalid indices
 static int normalize(int index) {
@@ -95,21 +180,29 @@ static char** do_rename(char **args);
 static char** do_switch(char **args);
 static char** do_move(char **args);
 static char** do_clear(char **args);
+static char** do_daemon(char **args);
+static char** do_subscribe(char **args);
+static char** do_list(char **args);
+static char** do_stats(char **args);
+
+static int handle_pending_events(void);
+static int run_batch(const char *path);
+static int load_rcfile(const char *path);
+static char *expand_home(const char *path);
+static int run_commands(char **args, int sync);
+static int run_guarded(char **args);
 
 int main(int argc, char **argv)
 {
+    int remote = 0;
+
+    cmd_out = stdout;
+    cmd_err = stderr;
+
     my_name = argv[0];
     if (strrchr(my_name, '/'))
         my_name = strrchr(argv[0], '/') + 1;
 
-    if ((dpy = XOpenDisplay(NULL)) == NULL)
-        return 1;
-
-    root = DefaultRootWindow(dpy);
-
-    if (!x11_init(dpy, root))
-        return 1;
-
     // Process global options
     char **args = argv + 1;
     while (*args) {
@@ -125,36 +218,84 @@ int main(int argc, char **argv)
             // if it doesn't exist. We don't do this for the default.
             if (access(rcfile, F_OK) == -1)
                 usage("Specified config doesn't exist: %s\n", rcfile);
+        } else if (get_str_flag(&args, 'm', &shmname)) {
+        } else if (get_flag(&args, 'c')) {
+            remote = 1;
+        } else if (get_str_flag(&args, 'T', &tracefile)) {
+            if (!trace_open(tracefile))
+                return 1;
+        } else if (get_str_flag(&args, 'b', &batchfile)) {
+        } else if (get_int_flag(&args, 'w', &confirm_ms)) {
+            if (confirm_ms < 0)
+                confirm_ms = 0;
         } else {
             usage("Unrecognized option: %s\n", args[0]);
         }
     }
 
+    if (!args[0] && !batchfile)
+        usage("No commands specified.\n");
+    if (args[0] && batchfile)
+        usage("Commands can't be given along with -b\n");
+
+    // Hand the commands to a daemon if one is running; otherwise fall back
+    // to doing the work ourselves. Batches always run locally.
+    if (remote && !batchfile) {
+        int flags = (verbose   ? DAEMON_VERBOSE   : 0) |
+                    (no_action ? DAEMON_NO_ACTION : 0);
+        int status = daemon_send(args, flags);
+        if (status >= 0)
+            return status;
+    }
+
     // Read the config if it exists
-    if (access(rcfile, F_OK) != -1) {
-        FILE *f = fopen(rcfile, "r");
-        if (!f) {
-            perror(rcfile);
-            return 1;
-        }
+    rcfile = expand_home(rcfile);
+    if (access(rcfile, F_OK) != -1 && !load_rcfile(rcfile))
+        return 1;
 
-        // TODO
+    trace_begin("XOpenDisplay");
+    dpy = XOpenDisplay(NULL);
+    trace_end();
+    if (dpy == NULL)
+        return 1;
 
-        fclose(f);
+    root = DefaultRootWindow(dpy);
+
+    trace_begin("x11_init");
+    int ok = x11_init(dpy, root);
+    trace_end();
+    if (!ok)
+        return 1;
+
+    // Window metadata kept across invocations; only mapped once needed.
+    static char cachefile[256];
+    if (daemon_runtime_path(cachefile, sizeof(cachefile), ".cache"))
+        cache_open(cachefile);
+
+    if (shmname) {
+        if (!shm_init(shmname))
+            return 1;
+        shm_publish();
     }
 
-    if (!args[0])
-        usage("No commands specified.\n");
+    if (batchfile)
+        return run_batch(batchfile);
+
+    run_commands(args, 1);
+
+    return 0;
+}
 
+// Runs each command in turn. Failures exit the process unless fail_env is
+// set, in which case they unwind out of here.
+static int run_commands(char **args, int sync)
+{
     while (*args) {
 
         // Prior to each command, handle pending events.
-        while (XPending(dpy)) {
-            XEvent ev;
-            XNextEvent(dpy, &ev);
-            x11_handle_event(&ev);
-        }
+        handle_pending_events();
 
+        trace_begin(args[0]);
         if (strcmp(args[0], "add") == 0) {
             args = do_add(args+1);
         } else if (strcmp(args[0], "remove") == 0) {
@@ -167,16 +308,170 @@ int main(int argc, char **argv)
             args = do_move(args+1);
         } else if (strcmp(args[0], "clear") == 0) {
             args = do_clear(args+1);
+        } else if (strcmp(args[0], "sync") == 0) {
+            if (!x11_wait_confirmed(confirm_ms, handle_pending_events))
+                fail();
+            args++;
+        } else if (strcmp(args[0], "daemon") == 0) {
+            args = do_daemon(args+1);
+        } else if (strcmp(args[0], "subscribe") == 0) {
+            args = do_subscribe(args+1);
+        } else if (strcmp(args[0], "list") == 0) {
+            args = do_list(args+1);
+        } else if (strcmp(args[0], "stats") == 0) {
+            args = do_stats(args+1);
         } else {
             usage("Unrecognized command: %s\n", args[0]);
         }
+        trace_end();
 
-        // Sync after each command
-        XSync(dpy, 0);
+        // Sync after each command, so the next one sees its effects.
+        if (sync && !x11_wait_confirmed(confirm_ms, handle_pending_events))
+            fail();
 
     }
 
-    return 0;
+    return 1;
+}
+
+// Entry point for commands forwarded to the daemon or read in batch mode.
+// Returns 0 if any command failed, leaving the process running.
+static int run_guarded(char **args)
+{
+    jmp_buf env;
+    int mark = trace_mark();
+    if (setjmp(env)) {
+        fail_env = NULL;
+        trace_unwind(mark);
+        return 0;
+    }
+
+    fail_env = &env;
+    int rv = run_commands(args, 0);
+    fail_env = NULL;
+
+    return rv;
+}
+
+// Returns the X11_CHANGED_* flags of all events handled.
+static int handle_pending_events(void)
+{
+    int changed = 0;
+    while (XPending(dpy)) {
+        XEvent ev;
+        XNextEvent(dpy, &ev);
+        changed |= x11_handle_event(&ev);
+    }
+
+    // Publish once per batch rather than once per event.
+    if (changed)
+        shm_publish();
+
+    return changed;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Run commands from a file, one line at a time, over this one connection.
+// A failing line is reported and skipped. Returns the exit status.
+static int run_batch(const char *path)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        fprintf(cmd_err, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t alloc = 0;
+    int lineno = 0, failed = 0;
+    char *words[256];
+
+    while (getline(&line, &alloc, f) >= 0) {
+        lineno++;
+        int n = split_words(line, words, 255);
+        if (n == 0)
+            continue;
+
+        if (n < 0 || !run_guarded(words)) {
+            fprintf(cmd_err, "%s:%d: command failed\n", path, lineno);
+            failed = 1;
+        }
+    }
+
+    free(line);
+    if (f != stdin)
+        fclose(f);
+
+    if (!x11_wait_confirmed(confirm_ms, handle_pending_events))
+        failed = 1;
+
+    return failed;
+}
+
+// The config file is line-oriented, using the same quoting as batch mode:
+//   # comment
+//   rule (class|title|exec) <pattern> <desktop name>
+static int load_rcfile(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(cmd_err, "%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    char *line = NULL;
+    size_t alloc = 0;
+    int lineno = 0, ok = 1;
+    char *words[16];
+
+    while (ok && getline(&line, &alloc, f) >= 0) {
+        lineno++;
+        int n = split_words(line, words, 15);
+        if (n == 0)
+            continue;
+
+        if (n > 0 && strcmp(words[0], "rule") == 0) {
+            int field = (n == 4 ? rules_field(words[1]) : -1);
+            if (field < 0 || !rules_add(field, words[2], words[3])) {
+                fprintf(cmd_err, "%s:%d: expected "
+                        "rule (class|title|exec) <pattern> <desktop>\n",
+                        path, lineno);
+                ok = 0;
+            }
+        } else {
+            fprintf(cmd_err, "%s:%d: unrecognized line\n", path, lineno);
+            ok = 0;
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    // Compile once, so matching new windows never depends on rule count.
+    if (ok && !rules_compile()) {
+        fprintf(cmd_err, "Failed to compile rules\n");
+        ok = 0;
+    }
+
+    return ok;
+}
+
+// Expand a leading ~/ to $HOME. The result is never freed.
+static char *expand_home(const char *path)
+{
+    const char *home = getenv("HOME");
+    if (path[0] != '~' || path[1] != '/' || !home)
+        return (char*)path;
+
+    char *rv = malloc(strlen(home) + strlen(path));
+    sprintf(rv, "%s%s", home, path + 1);
+    return rv;
 }
 
 //////////////////////////////// Commands /////////////////////////////////////
@@ -200,19 +495,21 @@ static char** do_add(char **args)
     if (index < 0 || index > x11_num_desktops)
         index = x11_num_desktops;
 
-    // Increase the number of desktops by 1
-    if (!x11_set_num_desktops(x11_num_desktops+1))
-        exit(1);
-
-    if (index != x11_num_desktops - 1) {
-        // Hard case: new desktop goes in the middle, so we need to rename 
-        // all the desktops that were offset and move their windows.
-        for (int i = x11_num_desktops - 1; i > index; i--) {
-            if (!x11_set_desktop_name(i, x11_get_desktop_name(i-1)))
-                exit(1);
-            if (!x11_move_windows(i-1, i))
-                exit(1);
-        }
+    int n = x11_num_desktops;
+    if (index == n) {
+        // Simple case: add at the end
+        if (!x11_set_num_desktops(n + 1))
+            fail();
+    } else {
+        // Hard case: new desktop goes in the middle, so the desktops after
+        // it shift up one, taking their windows and names along.
+        int map[n], src[n + 1];
+        for (int i = 0; i < n; i++)
+            map[i] = (i < index ? i : i + 1);
+        for (int j = 0; j <= n; j++)
+            src[j] = (j < index ? j : j == index ? -1 : j - 1);
+        if (!x11_remap_desktops(map, src, n + 1, -1))
+            fail();
     }
     
     x11_set_desktop_name(index, name);
@@ -226,7 +523,7 @@ static char** do_add(char **args)
 
     // Switch to the new desktop (or to stay on the current desktop)
     if (!stay && !x11_set_active_desktop(index))
-        exit(1);
+        fail();
 
     return args;
 }
@@ -249,18 +546,19 @@ static char** do_remove(char **args)
     }
     
     if (x11_num_desktops == 1) {
-        fprintf(stderr, "Can't remove the only desktop\n");
-        exit(1);
+        fprintf(cmd_err, "Can't remove the only desktop\n");
+        fail();
     }
 
-    // TODO: respect close flag
-
-
     // Make sure index is valid.
     if (index == INT_UNSET)
         index = x11_active_desktop;
     if (index < 0 || index >= x11_num_desktops)
         index = x11_num_desktops - 1;
+
+    // Windows that don't close right away still get moved below.
+    if (close && !x11_close_windows(index))
+        fail();
     
     // Finalize the desktop to switch to.
     // The index is pre-removal, so it may need to be decremented.
@@ -280,19 +578,25 @@ static char** do_remove(char **args)
     if (index == x11_num_desktops - 1) {
         // Simple case: remove last desktop
         if (!x11_move_windows(index, dest))
-            exit(1);
+            fail();
         if (!x11_set_num_desktops(x11_num_desktops-1))
-            exit(1);
+            fail();
     } else {
         // Hard case: remove from middle, so we need to shift and rename 
-        // desktops that came after. 
-
-        
-
+        // desktops that came after. Orphans go straight to dest, which is
+        // already in post-removal numbering.
+        int n = x11_num_desktops;
+        int map[n], src[n];
+        for (int i = 0; i < n; i++) {
+            map[i] = (i < index ? i : i == index ? dest : i - 1);
+            src[i] = (i < index ? i : i + 1);
+        }
+        if (!x11_remap_desktops(map, src, n - 1, -1))
+            fail();
     }
 
     if (!x11_set_active_desktop(switchto))
-        exit(1);
+        fail();
 
     return args;
 }
@@ -311,7 +615,7 @@ static char** do_rename(char **args)
 
     index = normalize(index);
     if (!x11_set_desktop_name(index, name))
-        exit(1);
+        fail();
 
     return args;
 }
@@ -358,7 +662,7 @@ static char** do_switch(char **args)
     } else goto fail;
 
     if (!x11_set_active_desktop(index))
-        exit(1);
+        fail();
 
     return args;
 
@@ -389,7 +693,7 @@ static char** do_move(char **args)
     src = normalize(src);
 
     if (!x11_move_windows(src, dst))
-        exit(1);
+        fail();
     
     return args;
 }
@@ -404,8 +708,462 @@ static char** do_clear(char **args)
         } else usage("Unrecognized option to clear: %s\n", args[0]);
     }
 
-    // TODO
+    if (index == INT_UNSET)
+        index = x11_active_desktop;
+    index = normalize(index);
+
+    if (!x11_close_windows(index))
+        fail();
+
+    return args;
+}
+
+static char** do_daemon(char **args)
+{
+    daemon_opts_t opts = { .coalesce_ms = 40, .confirm_ms = confirm_ms };
+    char *cgroup = NULL;
+
+    while (*args) {
+        if (args[0][0] != '-') break;
+        if (get_flag(&args, 'y')) {
+            opts.dynamic = 1;
+        } else if (get_int_flag(&args, 'w', &opts.coalesce_ms)) {
+            if (opts.coalesce_ms < 0)
+                opts.coalesce_ms = 0;
+        } else if (get_str_flag(&args, 'g', &cgroup)) {
+            opts.cgroup = cgroup;
+        } else if (get_flag(&args, 'F')) {
+            opts.freeze = 1;
+        } else if (get_int_flag(&args, 'R', &opts.reclaim_s)) {
+            if (opts.reclaim_s < 0)
+                opts.reclaim_s = 0;
+        } else usage("Unrecognized option to daemon: %s\n", args[0]);
+    }
+
+    if (opts.freeze && !opts.cgroup)
+        usage("-F needs a cgroup to freeze (-g)\n");
+
+    if (fail_env)
+        usage("The daemon command must be given on the command line\n");
+
+    // Long-lived modes mirror everything up front.
+    if (!x11_require(X11_NEED_NAMES | X11_NEED_WINDOWS))
+        fail();
+    x11_enable_placement();
+
+    if (!daemon_run(dpy, run_guarded, &opts))
+        fail();
+
+    return args;
+}
+
+static void json_put_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (const unsigned char *c = (const unsigned char*)str; c && *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(f, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(f, "\\u%04x", *c);
+        else
+            fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+static void print_state_json(FILE *f, int changed)
+{
+    static const struct {
+        int flag;
+        const char *name;
+    } changes[] = {
+        { X11_CHANGED_ACTIVE,    "switched"  },
+        { X11_CHANGED_COUNT,     "desktops"  },
+        { X11_CHANGED_NAMES,     "renamed"   },
+        { X11_CHANGED_CREATED,   "created"   },
+        { X11_CHANGED_DESTROYED, "destroyed" },
+        { X11_CHANGED_MOVED,     "moved"     },
+    };
+
+    fputs("{\"changed\":[", f);
+    const char *sep = "";
+    for (int i = 0; i < sizeof(changes) / sizeof(changes[0]); i++) {
+        if (changed & changes[i].flag) {
+            fprintf(f, "%s\"%s\"", sep, changes[i].name);
+            sep = ",";
+        }
+    }
+
+    fprintf(f, "],\"active\":%d,\"sticky\":%d,\"desktops\":[",
+            x11_active_desktop, x11_count_windows(-1));
+    for (int i = 0; i < x11_num_desktops; i++) {
+        fputs(i ? ",{\"name\":" : "{\"name\":", f);
+        json_put_string(f, x11_get_desktop_name(i));
+        fprintf(f, ",\"windows\":%d}", x11_count_windows(i));
+    }
+    fputs("]}\n", f);
+    fflush(f);
+}
+
+static char** do_subscribe(char **args)
+{
+    int debounce = 50;
+
+    while (*args) {
+        if (args[0][0] != '-') break;
+        if (get_int_flag(&args, 'w', &debounce)) {
+        } else usage("Unrecognized option to subscribe: %s\n", args[0]);
+    }
+
+    if (fail_env)
+        usage("The subscribe command must be given on the command line\n");
+
+    if (!x11_require(X11_NEED_NAMES | X11_NEED_WINDOWS))
+        fail();
+    x11_enable_placement();
+
+    if (debounce < 0)
+        debounce = 0;
+
+    // A burst that never goes quiet still gets reported eventually.
+    const long long max_delay = 10LL * debounce;
+
+    XSync(dpy, 0);
+    handle_pending_events();
+    print_state_json(cmd_out, 0);
+
+    int pending = 0;
+    long long first = 0, last = 0;
+    struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+
+    while (1) {
+        int timeout = -1;
+        if (pending) {
+            long long now = now_ms();
+            long long due = last + debounce;
+            if (due > first + max_delay)
+                due = first + max_delay;
+            timeout = (due > now ? due - now : 0);
+        }
+
+        // Events may already be buffered by Xlib, in which case the socket
+        // won't poll readable.
+        if (!XPending(dpy) && poll(&pfd, 1, timeout) < 0)
+            continue;
+
+        int changed = handle_pending_events();
+        long long now = now_ms();
+        if (changed) {
+            if (!pending)
+                first = now;
+            last = now;
+            pending |= changed;
+        }
+
+        if (pending && (now - last >= debounce || now - first >= max_delay)) {
+            print_state_json(cmd_out, pending);
+            pending = 0;
+        }
+    }
+
+    return args;
+}
+
+// Whether pid is ancestor or one of its descendants. Processes newer than
+// the tree are followed up through /proc until they reach one it knows.
+static int descends_from(pstree_node_t *tree, int pid, int ancestor)
+{
+    pstree_node_t *n;
+    while (!(n = pstree_find(tree, pid))) {
+        pstree_stat_t st;
+        if (pid == ancestor)
+            return 1;
+        if (pid <= 1 || !pstree_read_stat(pid, &st))
+            return 0;
+        pid = st.ppid;
+    }
+
+    for (; n; n = n->parent)
+        if (n->pid == ancestor)
+            return 1;
+    return 0;
+}
+
+// Desktop order, with sticky windows last.
+static int compare_windows(const void *a, const void *b)
+{
+    const x11_window_t *wa = a, *wb = b;
+    unsigned da = wa->desktop, db = wb->desktop;
+    if (da != db)
+        return da < db ? -1 : 1;
+    return (wa->window > wb->window) - (wa->window < wb->window);
+}
+
+static char** do_list(char **args)
+{
+    int   desktop = X11_ALL_DESKTOPS;
+    int   ancestor = 0;
+    char *exec = NULL;
+    char  format = 0;
+
+    while (*args) {
+        if (args[0][0] != '-') break;
+        if (get_int_flag(&args, 'i', &desktop)) {
+            if (desktop < 0)
+                usage("Desktop index must not be negative: %d\n", desktop);
+        } else if (get_flag(&args, 's')) {
+            desktop = -1;
+        } else if (get_int_flag(&args, 'p', &ancestor)) {
+        } else if (get_str_flag(&args, 'e', &exec)) {
+        } else if (get_flag(&args, 't')) {
+            format = 't';
+        } else if (get_flag(&args, 'j')) {
+            format = 'j';
+        } else usage("Unrecognized option to list: %s\n", args[0]);
+    }
+
+    // Everything below comes from the mirror and /proc; once it is loaded
+    // (and in the daemon it always is), listing makes no X requests.
+    if (!x11_require(X11_NEED_NAMES | X11_NEED_PIDS))
+        fail();
+
+    int count = x11_get_windows(desktop, NULL, 0);
+    x11_window_t *windows = malloc((count + 1) * sizeof(windows[0]));
+    count = x11_get_windows(desktop, windows, count);
+    qsort(windows, count, sizeof(windows[0]), compare_windows);
+
+    // Ancestry needs a process tree. The daemon keeps a recent one.
+    pstree_node_t *tree = NULL, *own_tree = NULL;
+    if (ancestor > 0) {
+        tree = daemon_pstree();
+        if (!tree)
+            tree = own_tree = pstree_create();
+        if (!tree) {
+            free(windows);
+            fail();
+        }
+    }
+
+    if (format == 'j')
+        fputs("[", cmd_out);
+    else if (!format)
+        fprintf(cmd_out, "%-10s %4s %7s %-15s %s\n",
+                "WINDOW", "DESK", "PID", "EXEC", "DESKTOP NAME");
+
+    const char *sep = "\n";
+    for (int i = 0; i < count; i++) {
+        x11_window_t *w = &windows[i];
+
+        if (ancestor > 0 && (!w->pid || !descends_from(tree, w->pid, ancestor)))
+            continue;
+
+        const char *name = "";
+        pstree_stat_t st;
+        pstree_node_t *node = NULL;
+        if (tree && w->pid)
+            node = pstree_find(tree, w->pid);
+        if (node)
+            name = node->exec;
+        else if (w->pid && pstree_read_stat(w->pid, &st))
+            name = st.comm;
+        // The names above are cut short at 15 characters, so match on the
+        // executable's full file name where it can be read.
+        if (exec) {
+            char exe_name[256];
+            const char *match = name;
+            if (w->pid && pstree_read_exe_name(w->pid, exe_name,
+                                               sizeof(exe_name)))
+                match = exe_name;
+            if (strcmp(exec, match) != 0)
+                continue;
+        }
+
+        const char *desk_name = (w->desktop >= 0 ?
+                x11_get_desktop_name(w->desktop) : NULL);
+        if (!desk_name)
+            desk_name = "";
+
+        if (format == 't') {
+            fprintf(cmd_out, "0x%08lx\t%d\t%d\t%s\t%s\n",
+                    w->window, w->desktop, w->pid, name, desk_name);
+        } else if (format == 'j') {
+            fprintf(cmd_out, "%s{\"window\":\"0x%08lx\",\"desktop\":%d,"
+                    "\"pid\":%d,\"exec\":", sep, w->window, w->desktop,
+                    w->pid);
+            json_put_string(cmd_out, name);
+            fputs(",\"name\":", cmd_out);
+            json_put_string(cmd_out, desk_name);
+            fputs("}", cmd_out);
+            sep = ",\n";
+        } else {
+            char desk[16], pid[16];
+            if (w->desktop >= 0)
+                sprintf(desk, "%d", w->desktop);
+            else
+                strcpy(desk, "*");
+            if (w->pid)
+                sprintf(pid, "%d", w->pid);
+            else
+                strcpy(pid, "-");
+            fprintf(cmd_out, "0x%08lx %4s %7s %-15s %s\n",
+                    w->window, desk, pid, name, desk_name);
+        }
+    }
+
+    if (format == 'j')
+        fputs("\n]\n", cmd_out);
+    fflush(cmd_out);
+
+    pstree_free(own_tree);
+    free(windows);
+    return args;
+}
+
+static void print_usage_json(const stats_usage_t *u)
+{
+    fprintf(cmd_out, "{\"procs\":%d,\"threads\":%d,",
+            u->num_procs, u->num_threads);
+    if (u->running >= 0)
+        fprintf(cmd_out, "\"running\":%d,", u->running);
+    fprintf(cmd_out, "\"rss\":%llu,\"cpu_ms\":%llu,\"cpu\":",
+            u->rss, u->cpu_ms);
+    if (u->cpu >= 0)
+        fprintf(cmd_out, "%.1f}", 100 * u->cpu);
+    else
+        fputs("null}", cmd_out);
+}
+
+// paged is left out if negative.
+static void print_usage(const char *desk, const char *name,
+                        const stats_usage_t *u, long long paged)
+{
+    char cpu[16];
+    if (u->cpu >= 0)
+        sprintf(cpu, "%.1f", 100 * u->cpu);
+    else
+        strcpy(cpu, "-");
+    fprintf(cmd_out, "%4s %6d %7d ", desk, u->num_procs, u->num_threads);
+    if (u->running >= 0)
+        fprintf(cmd_out, "%4d ", u->running);
+    fprintf(cmd_out, "%10.1f %10.1f %6s ",
+            u->rss / 1048576.0, u->cpu_ms / 1000.0, cpu);
+    if (paged >= 0)
+        fprintf(cmd_out, "%10.1f ", paged / 1048576.0);
+    fprintf(cmd_out, "%s\n", name);
+}
+
+static void print_stats(const stats_usage_t *usage, int count, char format)
+{
+    if (format == 'j') {
+        fputs("{\"desktops\":[", cmd_out);
+        for (int i = 0; i < count; i++) {
+            const char *name = x11_get_desktop_name(i);
+            fputs(i ? ",{\"name\":" : "{\"name\":", cmd_out);
+            json_put_string(cmd_out, name ? name : "");
+            fputs(",\"usage\":", cmd_out);
+            print_usage_json(&usage[i]);
+            if (daemon_reclaimed(i) >= 0)
+                fprintf(cmd_out, ",\"paged_out\":%lld", daemon_reclaimed(i));
+            fputs("}", cmd_out);
+        }
+        fputs("],\"shared\":", cmd_out);
+        print_usage_json(&usage[count]);
+        fputs("}\n", cmd_out);
+    } else {
+        // Memory paged out by the daemon's reclaim, if it is enabled.
+        int paged = (daemon_reclaimed(0) >= 0);
+        fprintf(cmd_out, "%4s %6s %7s ", "DESK", "PROCS", "THREADS");
+        if (usage[count].running >= 0)
+            fprintf(cmd_out, "%4s ", "RUN");
+        fprintf(cmd_out, "%10s %10s %6s ", "RSS MiB", "CPU s", "CPU %");
+        if (paged)
+            fprintf(cmd_out, "%10s ", "PAGED MiB");
+        fprintf(cmd_out, "%s\n", "DESKTOP NAME");
+        for (int i = 0; i < count; i++) {
+            char desk[16];
+            const char *name = x11_get_desktop_name(i);
+            sprintf(desk, "%d", i);
+            print_usage(desk, name ? name : "", &usage[i],
+                        daemon_reclaimed(i));
+        }
+        print_usage("*", "(shared)", &usage[count], paged ? 0 : -1);
+    }
+    fflush(cmd_out);
+}
+
+static char** do_stats(char **args)
+{
+    int  interval = 0;
+    int  flags = 0;
+    char format = 0;
+
+    while (*args) {
+        if (args[0][0] != '-') break;
+        if (get_int_flag(&args, 'w', &interval)) {
+        } else if (get_flag(&args, 'T')) {
+            flags |= PSTREE_THREADS;
+        } else if (get_flag(&args, 'j')) {
+            format = 'j';
+        } else usage("Unrecognized option to stats: %s\n", args[0]);
+    }
+
+    if (interval > 0 && fail_env)
+        usage("stats -w must be given on the command line\n");
+
+    // Listing threads means scanning every task directory, which the daemon
+    // won't do on the thread that serves X.
+    if ((flags & PSTREE_THREADS) && daemon_running())
+        usage("stats -T can't be run by the daemon\n");
+
+    if (!x11_require(X11_NEED_NAMES | X11_NEED_PIDS))
+        fail();
+
+    pstree_node_t *own_tree = NULL;
+    long long tree_time = 0;
+    stats_usage_t *usage = NULL;
+    int changed = 0;
+    struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+
+    while (1) {
+        // The daemon keeps a recent tree, but without threads. Otherwise,
+        // rescan when windows appear, and now and then to pick up new
+        // children and threads; between scans, samples only reread the stat
+        // files of processes and threads already counted.
+        pstree_node_t *tree = (flags ? NULL : daemon_pstree());
+        if (!tree) {
+            long long now = now_ms();
+            if (!own_tree || (changed & X11_CHANGED_CREATED) ||
+                    now - tree_time >= STATS_TREE_MS) {
+                pstree_free(own_tree);
+                own_tree  = pstree_create_flags(flags);
+                tree_time = now;
+            }
+            tree = own_tree;
+        }
+        stats_attribute(tree);
+
+        int count = x11_num_desktops;
+        usage = realloc(usage, (count + 1) * sizeof(usage[0]));
+        stats_sample(usage, count);
+        print_stats(usage, count, format);
+
+        if (interval <= 0)
+            break;
+        if (format != 'j')
+            fputc('\n', cmd_out);
+
+        // Keep the mirror current while waiting for the next sample.
+        changed = 0;
+        long long due = now_ms() + interval, now;
+        while ((now = now_ms()) < due) {
+            if (!XPending(dpy))
+                poll(&pfd, 1, due - now);
+            changed |= handle_pending_events();
+        }
+    }
 
+    pstree_free(own_tree);
+    free(usage);
     return args;
 }
 
@@ -0,0 +1,269 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "vtabs_cache.h"
+#include "pstree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC    0x76746363   // "vtcc"
+#define CACHE_VERSION  2
+#define CACHE_SLOTS    4096         // power of two
+#define CACHE_PROBES   8
+
+typedef struct {
+    uint32_t seq;         // odd while the slot is being written
+    uint32_t pid;
+    uint64_t window;      // 0 if the slot is free
+    uint64_t starttime;   // of pid
+} cache_entry_t;
+
+typedef struct {
+    uint32_t      magic;
+    uint32_t      version;
+    char          boot_id[40];
+    cache_entry_t slots[CACHE_SLOTS];
+} cache_file_t;
+
+extern int verbose;
+extern FILE *cmd_out, *cmd_err;
+
+static const char   *cache_path = NULL;
+static cache_file_t *cache      = NULL;
+static int           cache_fd   = -1;
+
+static int  cache_map(void);
+static void cache_write(cache_entry_t *e, const cache_entry_t *value);
+static int  compare_windows(const void *a, const void *b);
+
+void cache_open(const char *path)
+{
+    cache_path = path;
+}
+
+// Probes start at a hash of the window ID. IDs are a per-client base plus a
+// small counter, so the low bits alone would cluster.
+static unsigned cache_hash(unsigned long window)
+{
+    return ((uint64_t)window * 0x9e3779b97f4a7c15ull) >> 52;
+}
+
+int cache_lookup(unsigned long window, uint32_t *pid)
+{
+    if (!cache_map())
+        return 0;
+
+    unsigned h = cache_hash(window);
+    for (int i = 0; i < CACHE_PROBES; i++) {
+        cache_entry_t *e = &cache->slots[(h + i) & (CACHE_SLOTS - 1)];
+        cache_entry_t copy;
+
+        // A slot being written, or one whose writer died, is just a miss;
+        // nobody waits on another process.
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(&copy, e, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        if (copy.window != window)
+            continue;
+
+        pstree_stat_t st;
+        if (!pstree_read_stat(copy.pid, &st) ||
+                st.starttime != copy.starttime)
+            return 0;
+
+        *pid = copy.pid;
+        return 1;
+    }
+
+    return 0;
+}
+
+void cache_store(unsigned long window, uint32_t pid)
+{
+    if (!window || !pid || !cache_map())
+        return;
+
+    pstree_stat_t st;
+    if (!pstree_read_stat(pid, &st))
+        return;
+    cache_entry_t value = { .pid = pid, .window = window,
+                            .starttime = st.starttime };
+
+    flock(cache_fd, LOCK_EX);
+
+    // Reuse the window's own slot, else a free one, else evict the first.
+    unsigned h = cache_hash(window);
+    cache_entry_t *slot = NULL;
+    for (int i = 0; i < CACHE_PROBES; i++) {
+        cache_entry_t *e = &cache->slots[(h + i) & (CACHE_SLOTS - 1)];
+        if (e->window == window) {
+            slot = e;
+            break;
+        }
+        if (!slot && !e->window)
+            slot = e;
+    }
+    if (!slot)
+        slot = &cache->slots[h & (CACHE_SLOTS - 1)];
+
+    cache_write(slot, &value);
+    flock(cache_fd, LOCK_UN);
+}
+
+void cache_forget(unsigned long window)
+{
+    if (!cache_map())
+        return;
+
+    // Lookups scan every probe rather than stopping at a free slot, so
+    // slots can be freed without tombstones. Most destroyed windows are
+    // menus and tooltips that were never cached, so check before locking.
+    static const cache_entry_t empty = { 0 };
+    unsigned h = cache_hash(window);
+    int locked = 0;
+
+    for (int i = 0; i < CACHE_PROBES; i++) {
+        cache_entry_t *e = &cache->slots[(h + i) & (CACHE_SLOTS - 1)];
+        if (__atomic_load_n(&e->window, __ATOMIC_RELAXED) != window)
+            continue;
+        if (!locked) {
+            flock(cache_fd, LOCK_EX);
+            locked = 1;
+        }
+        if (e->window == window)
+            cache_write(e, &empty);
+    }
+
+    if (locked)
+        flock(cache_fd, LOCK_UN);
+}
+
+void cache_prune(const unsigned long *windows, int n)
+{
+    if (!cache_map())
+        return;
+
+    unsigned long *sorted = malloc(n * sizeof(sorted[0]) + 1);
+    memcpy(sorted, windows, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), compare_windows);
+
+    static const cache_entry_t empty = { 0 };
+    int locked = 0;
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+        cache_entry_t *e = &cache->slots[i];
+        unsigned long window = __atomic_load_n(&e->window, __ATOMIC_RELAXED);
+        if (!window || bsearch(&window, sorted, n, sizeof(sorted[0]),
+                               compare_windows))
+            continue;
+        if (!locked) {
+            flock(cache_fd, LOCK_EX);
+            locked = 1;
+        }
+        if (e->window == window)
+            cache_write(e, &empty);
+    }
+
+    if (locked)
+        flock(cache_fd, LOCK_UN);
+    free(sorted);
+}
+
+static int compare_windows(const void *a, const void *b)
+{
+    unsigned long wa = *(const unsigned long*)a;
+    unsigned long wb = *(const unsigned long*)b;
+    return (wa > wb) - (wa < wb);
+}
+
+// Write one slot under its seqlock. The caller holds the file lock, so seq
+// is ours to bump even if a dead writer left it odd.
+static void cache_write(cache_entry_t *e, const cache_entry_t *value)
+{
+    uint32_t seq = (e->seq | 1);
+    __atomic_store_n(&e->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    e->pid       = value->pid;
+    e->window    = value->window;
+    e->starttime = value->starttime;
+
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Map the cache file the first time it is needed. Failures just leave the
+// cache disabled; everything it holds can be fetched again.
+static int cache_map(void)
+{
+    static int tried = 0;
+    if (cache || tried || !cache_path)
+        return cache != NULL;
+    tried = 1;
+
+    // Never follow a link, and only use a plain file of our own: whatever
+    // is mapped here gets overwritten.
+    struct stat st;
+    int fd = open(cache_path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW,
+                  0600);
+    if (fd < 0) {
+        if (verbose)
+            fprintf(cmd_err, "%s: %s\n", cache_path, strerror(errno));
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+            st.st_uid != getuid()) {
+        if (verbose)
+            fprintf(cmd_err, "%s: not a file of ours\n", cache_path);
+        close(fd);
+        return 0;
+    }
+
+    // Start times count from boot, so entries from an earlier boot could
+    // match by accident.
+    char boot_id[40] = { 0 };
+    int id_fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (id_fd >= 0) {
+        if (read(id_fd, boot_id, sizeof(boot_id) - 1) < 0)
+            boot_id[0] = '\0';
+        close(id_fd);
+    }
+
+    flock(fd, LOCK_EX);
+
+    cache_file_t *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        (st.st_size >= sizeof(*cache) || ftruncate(fd, sizeof(*cache)) == 0))
+        map = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+
+    if (map == MAP_FAILED) {
+        if (verbose)
+            fprintf(cmd_err, "%s: %s\n", cache_path, strerror(errno));
+        flock(fd, LOCK_UN);
+        close(fd);
+        return 0;
+    }
+
+    if (map->magic != CACHE_MAGIC || map->version != CACHE_VERSION ||
+            memcmp(map->boot_id, boot_id, sizeof(boot_id)) != 0) {
+        memset(map, 0, sizeof(*map));
+        memcpy(map->boot_id, boot_id, sizeof(boot_id));
+        map->version = CACHE_VERSION;
+        map->magic   = CACHE_MAGIC;
+    }
+
+    flock(fd, LOCK_UN);
+
+    cache    = map;
+    cache_fd = fd;
+    return 1;
+}
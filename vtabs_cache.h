@@ -0,0 +1,45 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef VTABS_CACHE_H
+#define VTABS_CACHE_H
+
+#include <stdint.h>
+
+// Window metadata that outlives a single vtabs process. One file per display
+// lives on tmpfs and is mapped shared by every vtabs process on that display.
+// It maps a window ID to the local process that owns it, so a window seen
+// before costs no round trips at all.
+//
+// An entry is keyed by window ID and the owner's start time, and is only
+// trusted while it still describes a live process:
+//  - the pid's start time is read from /proc and must match, so an owner
+//    that exited, or a reused pid, misses;
+//  - the server only hands a window ID out again once its client has
+//    disconnected, which for nearly every client means it exited; entries
+//    are also dropped as soon as any vtabs process sees the window go away,
+//    or loads the client list without it, so an ID can only come back
+//    cached if it is reused between two vtabs runs;
+//  - the file records the boot it was written in, and is wiped on mismatch.
+// Only local clients are cached, since nothing about a remote one can be
+// checked. Entries are small fixed-size slots guarded by a per-slot seqlock,
+// so lookups take no locks; stores take an flock on the file.
+
+// Use the cache file at path. It is created and mapped on first use, so
+// commands that never look up a window pay nothing.
+void cache_open(const char *path);
+
+// Look up the local process owning a window. On a valid hit, sets *pid and
+// returns 1. Returns 0 on a miss or if there is no cache.
+int cache_lookup(unsigned long window, uint32_t *pid);
+
+// Record the local process owning a window, once found the slow way.
+void cache_store(unsigned long window, uint32_t pid);
+
+// Drop a window that has been destroyed, so its ID can't be matched if the
+// server hands it out again.
+void cache_forget(unsigned long window);
+
+// Drop every window not among the n current ones, which a one-shot vtabs
+// never sees destroyed.
+void cache_prune(const unsigned long *windows, int n);
+
+#endif
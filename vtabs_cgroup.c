@@ -0,0 +1,323 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "vtabs_cgroup.h"
+#include "vtabs_x11.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CGROUP_WEIGHT_ACTIVE  1000
+#define CGROUP_WEIGHT_IDLE    25
+#define CGROUP_WEIGHT_DEFAULT 100   // the kernel's own default
+
+// Leaves 0 to CGROUP_MAX_LEAVES - 1 belong to desktops; the one after them
+// is the shared leaf.
+#define CGROUP_MAX_LEAVES     64
+#define LEAF_SHARED           CGROUP_MAX_LEAVES
+
+typedef struct {
+    int created;
+    int weight;     // as last written, or 0
+    int frozen;     // as last written, or -1
+} leaf_t;
+
+// A process that owns windows, and the leaf they put it in.
+typedef struct {
+    int pid;
+    int leaf;
+    int tree_gen;   // generation of the tree it was placed with, 0 if unplaced
+    int complete;   // it was in that tree, so its descendants moved too
+} owner_t;
+
+extern int verbose;
+extern FILE *cmd_out, *cmd_err;
+
+static char   *base   = NULL;
+static int     freeze = 0;
+static int     active = -1;
+static leaf_t  leaves[CGROUP_MAX_LEAVES + 1];
+
+// Owners sorted by pid. The spare array is where the next list is built.
+static owner_t *owners = NULL, *spare = NULL;
+static int      num_owners   = 0;
+static int      owners_alloc = 0;
+
+// We and our ancestors, which may own windows too (say, the terminal the
+// daemon was started from), are never moved: freezing them would freeze us.
+#define CGROUP_MAX_ANCESTORS  32
+static int     ancestors[CGROUP_MAX_ANCESTORS];
+static int     num_ancestors = 0;
+
+// Trees are told apart by generation rather than address, since a new tree
+// may be allocated where a freed one was.
+static pstree_node_t *last_tree = NULL;
+static int            tree_gen  = 1;
+
+static int  cgroup_write(const char *dir, const char *file, const char *value,
+                         int mode);
+static void leaf_path(int leaf, char *buf, size_t len);
+static int  leaf_get(int leaf);
+static void leaf_apply(int leaf);
+static void load_owners(void);
+static void place_owner(owner_t *o, pstree_node_t *tree);
+static void move_subtree(pstree_node_t *node, const char *dir);
+static void move_pid(int pid, const char *dir);
+
+int cgroup_open(const char *dir, int _freeze)
+{
+    struct stat st;
+    if (stat(dir, &st) < 0 || access(dir, W_OK) < 0) {
+        fprintf(cmd_err, "%s: %s\n", dir, strerror(errno));
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(cmd_err, "%s is not a directory\n", dir);
+        return 0;
+    }
+
+    base   = strdup(dir);
+    freeze = _freeze;
+
+    // Weights need the cpu controller in our children; freezing is part of
+    // every cgroup v2 group.
+    if (!cgroup_write(base, "cgroup.subtree_control", "+cpu", O_TRUNC))
+        fprintf(cmd_err, "No cpu controller under %s; desktops won't be "
+                        "weighted\n", base);
+
+    // A daemon that was killed while desktops were frozen leaves them so.
+    DIR *d = opendir(base);
+    struct dirent *ent;
+    while (d && (ent = readdir(d)) != NULL) {
+        int index;
+        char path[PATH_MAX];
+        if (strcmp(ent->d_name, "shared") != 0 &&
+                sscanf(ent->d_name, "desk%d", &index) != 1)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", base, ent->d_name);
+        if (access(path, W_OK) == 0)
+            cgroup_write(path, "cgroup.freeze", "0", O_TRUNC);
+    }
+    if (d)
+        closedir(d);
+
+    return 1;
+}
+
+void cgroup_update(pstree_node_t *tree, int windows_changed)
+{
+    if (!base)
+        return;
+
+    if (tree != last_tree) {
+        last_tree = tree;
+        tree_gen++;
+    } else if (!windows_changed) {
+        return;
+    }
+
+    if (windows_changed)
+        load_owners();
+
+    // New placements, and owners that a newer tree may now show the
+    // descendants of.
+    for (int i = 0; i < num_owners; i++) {
+        owner_t *o = &owners[i];
+        if (!o->tree_gen || (!o->complete && o->tree_gen != tree_gen))
+            place_owner(o, tree);
+    }
+}
+
+void cgroup_activate(int desktop)
+{
+    if (!base)
+        return;
+
+    // Thaw the desktop being switched to before freezing anything else.
+    active = desktop;
+    if (active >= 0 && active < CGROUP_MAX_LEAVES && leaves[active].created)
+        leaf_apply(active);
+    for (int i = 0; i <= LEAF_SHARED; i++) {
+        if (i != active && leaves[i].created)
+            leaf_apply(i);
+    }
+}
+
+void cgroup_close(void)
+{
+    if (!base || !freeze)
+        return;
+
+    char dir[PATH_MAX];
+    for (int i = 0; i <= LEAF_SHARED; i++) {
+        if (!leaves[i].created || leaves[i].frozen == 0)
+            continue;
+        leaf_path(i, dir, sizeof(dir));
+        if (cgroup_write(dir, "cgroup.freeze", "0", O_TRUNC))
+            leaves[i].frozen = 0;
+    }
+}
+
+// Rebuild the owner list from the window mirror. Owners whose leaf didn't
+// change keep their placement; everyone else gets placed afresh.
+static void load_owners(void)
+{
+    const x11_owner_t *found;
+    int m = x11_get_owners(&found);
+    if (m > owners_alloc) {
+        owners_alloc = 2 * m;
+        owners = realloc(owners, owners_alloc * sizeof(owners[0]));
+        spare  = realloc(spare, owners_alloc * sizeof(spare[0]));
+    }
+
+    num_ancestors = pstree_ancestors(getpid(), ancestors, CGROUP_MAX_ANCESTORS);
+
+    for (int i = 0; i < m; i++) {
+        int leaf = found[i].desktop;
+        if (leaf < 0 || leaf >= CGROUP_MAX_LEAVES)
+            leaf = LEAF_SHARED;
+        spare[i] = (owner_t){ .pid = found[i].pid, .leaf = leaf };
+    }
+
+    // Both lists are sorted, so carry placements over in one pass.
+    for (int i = 0, j = 0; i < m; i++) {
+        while (j < num_owners && owners[j].pid < spare[i].pid)
+            j++;
+        if (j < num_owners && owners[j].pid == spare[i].pid &&
+                owners[j].leaf == spare[i].leaf) {
+            spare[i].tree_gen = owners[j].tree_gen;
+            spare[i].complete = owners[j].complete;
+        }
+    }
+
+    owner_t *tmp = owners;
+    owners     = spare;
+    spare      = tmp;
+    num_owners = m;
+}
+
+static void place_owner(owner_t *o, pstree_node_t *tree)
+{
+    char dir[PATH_MAX];
+    leaf_path(o->leaf, dir, sizeof(dir));
+
+    pstree_node_t *node = (tree ? pstree_find(tree, o->pid) : NULL);
+    o->tree_gen = tree_gen;
+    o->complete = (node != NULL);
+    if (!leaf_get(o->leaf))
+        return;
+
+    if (verbose)
+        fprintf(cmd_out, "Placing pid %d%s in %s\n", o->pid,
+                node ? " and descendants" : "", dir);
+
+    if (node)
+        move_subtree(node, dir);
+    else
+        move_pid(o->pid, dir);
+}
+
+// Descendants that own windows of their own are placed by their own entry.
+static void move_subtree(pstree_node_t *node, const char *dir)
+{
+    move_pid(node->pid, dir);
+
+    for (pstree_node_t *c = node->child; c; c = c->sibling) {
+        if (!x11_find_owner(c->pid))
+            move_subtree(c, dir);
+    }
+}
+
+static void move_pid(int pid, const char *dir)
+{
+    for (int i = 0; i < num_ancestors; i++) {
+        if (ancestors[i] == pid)
+            return;
+    }
+
+    char buf[16];
+    sprintf(buf, "%d\n", pid);
+    cgroup_write(dir, "cgroup.procs", buf, O_APPEND);
+}
+
+static void leaf_path(int leaf, char *buf, size_t len)
+{
+    if (leaf == LEAF_SHARED)
+        snprintf(buf, len, "%s/shared", base);
+    else
+        snprintf(buf, len, "%s/desk%d", base, leaf);
+}
+
+// Create a leaf the first time it is used, and bring it in line with the
+// active desktop.
+static int leaf_get(int leaf)
+{
+    if (leaves[leaf].created)
+        return 1;
+
+    char dir[PATH_MAX];
+    leaf_path(leaf, dir, sizeof(dir));
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        if (verbose)
+            fprintf(cmd_err, "%s: %s\n", dir, strerror(errno));
+        return 0;
+    }
+
+    leaves[leaf] = (leaf_t){ .created = 1, .weight = 0, .frozen = -1 };
+    leaf_apply(leaf);
+    return 1;
+}
+
+// Desktops other than the active one are idle. Leaves of desktops that no
+// longer exist only hold strays, which are left alone.
+static void leaf_apply(int leaf)
+{
+    leaf_t *l = &leaves[leaf];
+    int idle = (leaf != LEAF_SHARED && leaf != active &&
+                leaf < x11_num_desktops);
+    int weight = (idle ? CGROUP_WEIGHT_IDLE :
+                  leaf == active ? CGROUP_WEIGHT_ACTIVE :
+                  CGROUP_WEIGHT_DEFAULT);
+
+    char dir[PATH_MAX], value[16];
+    leaf_path(leaf, dir, sizeof(dir));
+
+    if (l->weight != weight) {
+        sprintf(value, "%d", weight);
+        if (cgroup_write(dir, "cpu.weight", value, O_TRUNC))
+            l->weight = weight;
+    }
+
+    if (freeze && l->frozen != idle) {
+        if (cgroup_write(dir, "cgroup.freeze", idle ? "1" : "0", O_TRUNC))
+            l->frozen = idle;
+    }
+}
+
+// Write a control file. mode is O_TRUNC for settings, O_APPEND for lists
+// like cgroup.procs, so a plain directory standing in for cgroupfs ends up
+// holding everything written. Processes that have exited aren't reported.
+static int cgroup_write(const char *dir, const char *file, const char *value,
+                        int mode)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    size_t len = strlen(value);
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | mode, 0644);
+    ssize_t n = (fd < 0 ? -1 : write(fd, value, len));
+    int err = errno;
+    if (fd >= 0)
+        close(fd);
+
+    if (n != len) {
+        if (verbose && err != ESRCH)
+            fprintf(cmd_err, "%s: %s\n", path, strerror(err));
+        return 0;
+    }
+    return 1;
+}
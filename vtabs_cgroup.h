@@ -0,0 +1,38 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef VTABS_CGROUP_H
+#define VTABS_CGROUP_H
+
+#include "pstree.h"
+
+// Per-desktop CPU control with cgroup v2. Inside a cgroup delegated to us,
+// each desktop gets a leaf group desk<N>, and processes with windows on
+// several desktops, or sticky windows, go to a leaf named shared. Placing a
+// window's process moves its descendants along with it, except those that
+// own windows of their own. Only windows the window manager has taken on
+// count, and the daemon itself and its ancestors are never moved. The
+// active desktop's leaf gets a high cpu.weight and the others a low one, or
+// with freezing, the others are frozen outright.
+//
+// Processes are only moved when their windows change. Forks need no help:
+// the kernel starts a child in its parent's group.
+
+// Use the cgroup at dir, which must be writable and hold no processes of its
+// own. Leaves are created as they are needed, and any a previous run left
+// frozen are thawed. Returns 0 if dir can't be used.
+int cgroup_open(const char *dir, int freeze);
+
+// Bring group membership up to date with the window mirror, which must have
+// pids loaded. Pass windows_changed after windows were created, destroyed,
+// moved, or changed pid; otherwise this only retries processes that weren't
+// in an older tree. tree may be NULL, in which case only the window owners
+// themselves move.
+void cgroup_update(pstree_node_t *tree, int windows_changed);
+
+// Weight or freeze the leaves for the given active desktop.
+void cgroup_activate(int desktop);
+
+// Thaw every leaf we froze, before the daemon exits. Processes stay where
+// they are.
+void cgroup_close(void);
+
+#endif
@@ -0,0 +1,1022 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#define _GNU_SOURCE     // struct ucred
+#include "vtabs_daemon.h"
+#include "vtabs_x11.h"
+#include "vtabs_shm.h"
+#include "vtabs_cgroup.h"
+#include "vtabs_stats.h"
+#include "vtabs_reclaim.h"
+#include "ringq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// declared in vtabs.c
+extern int verbose;
+extern int no_action;
+extern FILE *cmd_out, *cmd_err;
+
+#define DAEMON_EXECUTORS    4
+#define DAEMON_QUEUE_SIZE   64
+#define DAEMON_MAX_REQUEST  65536
+#define DAEMON_MAX_ARGS     1024
+
+// Background rescans happen at least this often, and no more often than the
+// minimum interval however many windows appear at once.
+#define PSTREE_INTERVAL_MS  5000
+#define PSTREE_MIN_MS       250
+
+// Dynamic desktops are rearranged once a burst of changes has been quiet
+// this long, and not again until the window manager has had time to apply
+// the previous rearrangement.
+#define DYNAMIC_DELAY_MS    100
+#define DYNAMIC_SETTLE_MS   500
+
+// A switch we sent counts as the active desktop until the window manager
+// reports it, or for this long if it never does.
+#define SWITCH_CONFIRM_MS   250
+
+// Idle desktops are paged out no faster than this, in bytes per second.
+#define RECLAIM_RATE        (64LL << 20)
+
+// How far up from us to look for processes that are never paged out.
+#define RECLAIM_MAX_ANCESTORS 32
+
+// A command queued by an executor. It lives on the executor's stack; the X
+// thread must not touch it after posting done.
+typedef struct {
+    char  *args[DAEMON_MAX_ARGS + 1];
+    int    flags;
+    int    out_fd;      // the client's stdout and stderr, or -1
+    int    err_fd;
+    int    status;
+    sem_t  done;
+} job_t;
+
+static Display        *dpy  = NULL;
+static daemon_exec_fn  exec = NULL;
+static daemon_opts_t   opts;
+static int             listen_fd = -1;
+
+static ringq_t jobs;        // executors -> X thread (MPSC)
+static int     jobs_wake = -1;
+
+static ringq_t refresh;     // X thread -> pstree thread (SPSC)
+static ringq_t trees;       // pstree thread -> X thread (either pops)
+static ringq_t retired;     // X thread -> pstree thread (SPSC)
+static int     pstree_wake = -1;
+
+static pstree_node_t *cur_tree = NULL;
+
+// A desktop whose processes the reclaim thread should page out. It hands
+// the job back with the result filled in.
+typedef struct {
+    int       desktop;
+    int       error;    // errno if process_madvise can't be used
+    long long bytes;
+    int       num_procs;
+    stats_proc_t procs[];
+} reclaim_job_t;
+
+static ringq_t    reclaims;      // X thread -> reclaim thread (SPSC)
+static ringq_t    reclaimed;     // reclaim thread -> X thread (SPSC)
+static int        reclaim_wake = -1;
+static int        reclaim_busy = -1;     // desktop being paged out, or -1
+                                         // (INT_MAX once it is removed)
+static int        reclaim_cancel = 0;    // set when it becomes active
+static int        reclaim_active = -1;   // active desktop as last seen
+static int        reclaim_alloc = 0;
+static long long *idle_since = NULL;     // per desktop; -1 if not idle
+static long long *reclaim_total = NULL;  // per desktop
+
+// X11_CHANGED_* flags from events handled since the main loop last looked,
+// including those handled while waiting for a command's confirmations.
+static int changed_since = 0;
+
+// Relative switches ("switch -r N", "switch -d N") are merged into a pending
+// target and sent as one switch once they stop arriving for coalesce_ms.
+// Any other command sends the pending switch first, so order is kept.
+static int       switch_target = -1;    // -1 if nothing is pending
+static long long switch_first  = 0;
+static long long switch_due    = -1;
+static int       switch_sent   = -1;    // until the mirror catches up
+static long long switch_sent_until = 0;
+
+// Merged switches are answered once the switch they were folded into has
+// been sent. There is at most one per executor.
+static job_t    *switch_jobs[DAEMON_EXECUTORS];
+static int       num_switch_jobs = 0;
+
+static void  wake(int fd);
+static FILE *open_stream(int fd);
+static int   relative_switch(job_t *job, int *delta, int *wrap);
+static void  merge_switch(int delta, int wrap);
+static void  flush_switch(void);
+static int   drain_events(void);
+static void  drain_wake(int fd);
+static int   peer_is_us(int fd);
+static void *executor_main(void *arg);
+static void *pstree_main(void *arg);
+static void *reclaim_main(void *arg);
+static long long update_reclaim(void);
+static void renumber_reclaim(const int *src, int m, long long now);
+static long long now_ms(void);
+
+int daemon_run(Display *_dpy, daemon_exec_fn _exec, 
+               const daemon_opts_t *_opts)
+{
+    dpy  = _dpy;
+    exec = _exec;
+    opts = *_opts;
+
+    // Writes to clients that went away shouldn't kill the daemon.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Signals that stop us are read in the event loop, so that frozen
+    // desktops can be thawed first. Threads started below inherit the mask.
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    int stop_fd = signalfd(-1, &stop, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (stop_fd < 0) {
+        perror("signalfd");
+        return 0;
+    }
+
+    if (!ringq_init(&jobs, DAEMON_QUEUE_SIZE)   ||
+        !ringq_init(&refresh, 4)                ||
+        !ringq_init(&trees, 4)                  ||
+        !ringq_init(&retired, 16)               ||
+        !ringq_init(&reclaims, 2)               ||
+        !ringq_init(&reclaimed, 2)) {
+        fprintf(stderr, "Failed to allocate daemon queues\n");
+        return 0;
+    }
+
+    jobs_wake   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pstree_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reclaim_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (jobs_wake < 0 || pstree_wake < 0 || reclaim_wake < 0) {
+        perror("eventfd");
+        return 0;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!daemon_runtime_path(addr.sun_path, sizeof(addr.sun_path),
+                             ".sock")) {
+        fprintf(stderr, "No usable path for the daemon socket\n");
+        return 0;
+    }
+
+    // Refuse to start if another daemon is answering on the socket;
+    // otherwise it is stale and can be replaced.
+    if (daemon_send(NULL, 0) >= 0) {
+        fprintf(stderr, "A daemon is already listening on %s\n",
+                addr.sun_path);
+        return 0;
+    }
+    unlink(addr.sun_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 16) < 0) {
+        perror(addr.sun_path);
+        return 0;
+    }
+
+    pthread_t tid;
+    for (int i = 0; i < DAEMON_EXECUTORS; i++) {
+        if (pthread_create(&tid, NULL, executor_main, NULL) != 0) {
+            fprintf(stderr, "Failed to start executor thread\n");
+            return 0;
+        }
+        pthread_detach(tid);
+    }
+    if (pthread_create(&tid, NULL, pstree_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start pstree thread\n");
+        return 0;
+    }
+    pthread_detach(tid);
+    if (opts.reclaim_s > 0) {
+        if (pthread_create(&tid, NULL, reclaim_main, NULL) != 0) {
+            fprintf(stderr, "Failed to start reclaim thread\n");
+            return 0;
+        }
+        pthread_detach(tid);
+        if (!x11_require(X11_NEED_PIDS))
+            return 0;
+    }
+
+    // Group membership needs pids, and is then kept up to date as windows
+    // come and go.
+    if (opts.cgroup) {
+        if (!cgroup_open(opts.cgroup, opts.freeze) ||
+                !x11_require(X11_NEED_PIDS))
+            return 0;
+        cgroup_activate(x11_active_desktop);
+        cgroup_update(daemon_pstree(), 1);
+    }
+
+    if (verbose)
+        printf("Listening on %s\n", addr.sun_path);
+
+    struct pollfd pfd[3] = {
+        { .fd = ConnectionNumber(dpy), .events = POLLIN },
+        { .fd = jobs_wake,             .events = POLLIN },
+        { .fd = stop_fd,               .events = POLLIN },
+    };
+    int ok = 1;
+
+    // Tidy up whatever state we start in.
+    long long dynamic_due  = (opts.dynamic ? now_ms() : -1);
+    long long dynamic_idle = 0;
+
+    XSync(dpy, 0);
+    while (1) {
+        drain_events();
+        int changed = changed_since;
+        changed_since = 0;
+
+        // Once the window manager has applied our last switch, the mirror
+        // is the best base for the next one. The mirror moves as soon as a
+        // switch is sent, so it is the event that counts.
+        if (switch_sent >= 0 && (((changed & X11_CHANGED_ACTIVE) &&
+                                  x11_active_desktop == switch_sent) ||
+                                 now_ms() >= switch_sent_until))
+            switch_sent = -1;
+        if (switch_due >= 0 && now_ms() >= switch_due)
+            flush_switch();
+
+        // New windows usually mean new processes.
+        if (changed & X11_CHANGED_CREATED) {
+            ringq_push(&refresh, (void*)1);
+            wake(pstree_wake);
+        }
+
+        // Only owners of changed windows are moved, so this is cheap when
+        // nothing happened; a newer tree lets placements reach descendants
+        // that weren't in the last one.
+        if (opts.cgroup) {
+            if (changed & (X11_CHANGED_ACTIVE | X11_CHANGED_COUNT))
+                cgroup_activate(x11_active_desktop);
+            cgroup_update(daemon_pstree(),
+                          changed & (X11_CHANGED_CREATED |
+                                     X11_CHANGED_DESTROYED |
+                                     X11_CHANGED_MOVED | X11_CHANGED_PID));
+        }
+
+        long long reclaim_due = update_reclaim();
+
+        // Occupancy counts are kept up to date by the event handlers, so
+        // this is just a flag check; the rearrangement itself waits for the
+        // burst to end so that many closes cost one desktop change.
+        if (x11_take_occupancy_changed() || (changed & X11_CHANGED_ACTIVE)) {
+            if (opts.dynamic)
+                dynamic_due = now_ms() + DYNAMIC_DELAY_MS;
+        }
+        if (dynamic_due >= 0) {
+            long long now = now_ms();
+            if (now >= dynamic_due && now < dynamic_idle) {
+                dynamic_due = dynamic_idle;
+            } else if (now >= dynamic_due) {
+                dynamic_due = -1;
+                // Back off after a failure too, since part of it may
+                // have been sent.
+                if (x11_update_dynamic() != 0)
+                    dynamic_idle = now + DYNAMIC_SETTLE_MS;
+                x11_wait_confirmed(opts.confirm_ms, drain_events);
+            }
+        }
+
+        job_t *job = ringq_pop(&jobs);
+        if (job) {
+            // Once every executor is waiting on a merged switch, nothing
+            // else can get in, so send it straight away.
+            int delta, wrap;
+            if (opts.coalesce_ms > 0 && relative_switch(job, &delta, &wrap)) {
+                merge_switch(delta, wrap);
+                switch_jobs[num_switch_jobs++] = job;
+                if (num_switch_jobs == DAEMON_EXECUTORS)
+                    flush_switch();
+                continue;
+            }
+
+            // A switch we sent stays the base for the next merge until the
+            // mirror catches up, unless the command moves the active
+            // desktop itself, after which only the mirror knows where we
+            // are.
+            flush_switch();
+            int active = x11_active_desktop;
+
+            int old_verbose = verbose, old_no_action = no_action;
+            verbose   |= !!(job->flags & (DAEMON_VERBOSE | DAEMON_NO_ACTION));
+            no_action |= !!(job->flags & DAEMON_NO_ACTION);
+
+            // Output goes to the client's terminal, not the daemon's. Only
+            // the command's own streams are pointed there; the other
+            // threads keep writing to the daemon's.
+            FILE *out = open_stream(job->out_fd);
+            FILE *err = open_stream(job->err_fd);
+            if (out)
+                cmd_out = out;
+            if (err) {
+                setvbuf(err, NULL, _IONBF, 0);
+                cmd_err = err;
+            }
+            job->status = (exec(job->args) &&
+                           x11_wait_confirmed(opts.confirm_ms, drain_events))
+                          ? 0 : 1;
+            if (x11_active_desktop != active)
+                switch_sent = -1;
+            cmd_out = stdout;
+            cmd_err = stderr;
+            if (out)
+                fclose(out);
+            if (err)
+                fclose(err);
+
+            verbose   = old_verbose;
+            no_action = old_no_action;
+
+            sem_post(&job->done);
+
+            // Go around again so events get handled between commands.
+            continue;
+        }
+
+        // Replies read during commands may have queued events that the
+        // socket will no longer report.
+        if (XPending(dpy))
+            continue;
+
+        long long due = dynamic_due;
+        if (switch_due >= 0 && (due < 0 || switch_due < due))
+            due = switch_due;
+        if (reclaim_due >= 0 && (due < 0 || reclaim_due < due))
+            due = reclaim_due;
+
+        int timeout = -1;
+        if (due >= 0) {
+            long long now = now_ms();
+            timeout = (due > now ? due - now : 0);
+        }
+
+        if (poll(pfd, 3, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            ok = 0;
+            break;
+        }
+        drain_wake(jobs_wake);
+
+        struct signalfd_siginfo si;
+        if (read(stop_fd, &si, sizeof(si)) == sizeof(si)) {
+            if (verbose)
+                printf("Stopping on signal %d\n", (int)si.ssi_signo);
+            break;
+        }
+    }
+
+    // Whatever froze while we ran would otherwise stay frozen until the
+    // next daemon starts. Clients connecting now find nobody listening.
+    cgroup_close();
+    unlink(addr.sun_path);
+    return ok;
+}
+
+// Returns 1 if the job is a single relative switch that can be merged,
+// setting *delta and whether it wraps around the ends.
+static int relative_switch(job_t *job, int *delta, int *wrap)
+{
+    char **args = job->args;
+    if (job->flags || x11_num_desktops <= 0 ||
+            !args[0] || !args[1] || !args[2] || args[3] ||
+            strcmp(args[0], "switch") != 0)
+        return 0;
+
+    if (strcmp(args[1], "-r") == 0)
+        *wrap = 1;
+    else if (strcmp(args[1], "-d") == 0)
+        *wrap = 0;
+    else
+        return 0;
+
+    char *end;
+    errno = 0;
+    long val = strtol(args[2], &end, 10);
+    if (errno || end == args[2] || *end || val < INT32_MIN || val > INT32_MAX)
+        return 0;
+
+    *delta = val;
+    return 1;
+}
+
+// Apply a relative switch to the pending target, the same way do_switch
+// would apply it to the active desktop.
+static void merge_switch(int delta, int wrap)
+{
+    long long now = now_ms();
+    int n = x11_num_desktops;
+
+    if (switch_target < 0) {
+        switch_target = (switch_sent >= 0 ? switch_sent : x11_active_desktop);
+        switch_first  = now;
+    }
+
+    long long target = (long long)switch_target + delta;
+    if (wrap) {
+        target %= n;
+        if (target < 0)
+            target += n;
+    } else if (target < 0) {
+        target = 0;
+    } else if (target >= n) {
+        target = n - 1;
+    }
+    switch_target = target;
+
+    // A key held down never goes quiet, but the display should still
+    // follow it now and then.
+    switch_due = now + opts.coalesce_ms;
+    if (switch_due > switch_first + 4LL * opts.coalesce_ms)
+        switch_due = switch_first + 4LL * opts.coalesce_ms;
+}
+
+static void flush_switch(void)
+{
+    if (switch_target < 0)
+        return;
+
+    char index[16];
+    sprintf(index, "%d", switch_target);
+    char *args[] = { "switch", "-i", index, NULL };
+
+    if (verbose)
+        printf("Sending merged switch to desktop %s\n", index);
+    int ok = exec(args);
+    if (ok) {
+        switch_sent = switch_target;
+        switch_sent_until = now_ms() + SWITCH_CONFIRM_MS;
+    }
+    ok &= x11_wait_confirmed(opts.confirm_ms, drain_events);
+    fflush(stdout);
+
+    for (int i = 0; i < num_switch_jobs; i++) {
+        switch_jobs[i]->status = (ok ? 0 : 1);
+        sem_post(&switch_jobs[i]->done);
+    }
+    num_switch_jobs = 0;
+
+    switch_target = -1;
+    switch_due = -1;
+}
+
+// Events handled here, including while waiting for confirmations, are left
+// in changed_since for the main loop to act on.
+static int drain_events(void)
+{
+    int changed = 0;
+    while (XPending(dpy)) {
+        XEvent ev;
+        XNextEvent(dpy, &ev);
+        changed |= x11_handle_event(&ev);
+    }
+    if (changed)
+        shm_publish();
+
+    changed_since |= changed;
+    return changed;
+}
+
+// Track how long each desktop has been idle, collect finished reclaims, and
+// hand the reclaim thread the next desktop that has been idle long enough.
+// Returns when a desktop will next be due, or -1.
+static long long update_reclaim(void)
+{
+    if (opts.reclaim_s <= 0)
+        return -1;
+
+    long long now = now_ms();
+
+    // Desktops renumbered by remap, add or remove take their counters along.
+    int src[X11_MAX_DESKTOPS];
+    int m = x11_take_renumbering(src);
+    if (m > 0)
+        renumber_reclaim(src, m, now);
+
+    int n = x11_num_desktops;
+    if (n > reclaim_alloc) {
+        idle_since    = realloc(idle_since, n * sizeof(idle_since[0]));
+        reclaim_total = realloc(reclaim_total, n * sizeof(reclaim_total[0]));
+        for (int i = reclaim_alloc; i < n; i++) {
+            idle_since[i]    = now;
+            reclaim_total[i] = 0;
+        }
+        reclaim_alloc = n;
+    }
+
+    // The desktop switched away from starts idling. The one switched to
+    // stops, and paging it out is called off. idle_since is also -1 for
+    // desktops that were paged out since they were last active.
+    int active = x11_active_desktop;
+    if (active != reclaim_active) {
+        if (reclaim_active >= 0 && reclaim_active < reclaim_alloc)
+            idle_since[reclaim_active] = now;
+        if (active >= 0 && active < reclaim_alloc)
+            idle_since[active] = -1;
+        if (active == reclaim_busy)
+            __atomic_store_n(&reclaim_cancel, 1, __ATOMIC_RELAXED);
+        reclaim_active = active;
+    }
+
+    reclaim_job_t *job;
+    while ((job = ringq_pop(&reclaimed)) != NULL) {
+        if (job->error) {
+            fprintf(stderr, "Can't page out memory: %s\n",
+                    strerror(job->error));
+            opts.reclaim_s = 0;
+        } else {
+            if (reclaim_busy < reclaim_alloc) {
+                reclaim_total[reclaim_busy] += job->bytes;
+                printf("Paged out %.1f MiB from desktop %d\n",
+                       job->bytes / 1048576.0, reclaim_busy);
+                fflush(stdout);
+            }
+        }
+        reclaim_busy = -1;
+        free(job);
+    }
+
+    // One desktop at a time; the result wakes us for the next.
+    if (opts.reclaim_s <= 0 || reclaim_busy >= 0)
+        return -1;
+
+    long long due = -1;
+    for (int i = 0; i < n; i++) {
+        if (idle_since[i] < 0)
+            continue;
+        long long at = idle_since[i] + opts.reclaim_s * 1000LL;
+        if (at > now) {
+            if (due < 0 || at < due)
+                due = at;
+            continue;
+        }
+
+        // Processes are attributed as for stats, so anything shared with
+        // another desktop is left alone.
+        idle_since[i] = -1;
+        stats_attribute(daemon_pstree());
+        int count = stats_procs(i, NULL, 0);
+        if (count == 0)
+            continue;
+
+        job = malloc(sizeof(*job) + count * sizeof(job->procs[0]));
+        job->desktop   = i;
+        job->error     = 0;
+        job->bytes     = 0;
+        job->num_procs = stats_procs(i, job->procs, count);
+
+        // As with cgroups, we and our ancestors (perhaps the window manager
+        // or the terminal we were started from) are never touched.
+        int ancestors[RECLAIM_MAX_ANCESTORS];
+        int num_ancestors = pstree_ancestors(getpid(), ancestors,
+                                             RECLAIM_MAX_ANCESTORS);
+        int kept = 0;
+        for (int j = 0; j < job->num_procs; j++) {
+            int k = 0;
+            while (k < num_ancestors && ancestors[k] != job->procs[j].pid)
+                k++;
+            if (k == num_ancestors)
+                job->procs[kept++] = job->procs[j];
+        }
+        job->num_procs = count = kept;
+        if (count == 0) {
+            free(job);
+            continue;
+        }
+        __atomic_store_n(&reclaim_cancel, 0, __ATOMIC_RELAXED);
+        if (!ringq_push(&reclaims, job)) {
+            free(job);
+            break;
+        }
+
+        if (verbose)
+            printf("Paging out %d processes of desktop %d\n", count, i);
+        reclaim_busy = i;
+        wake(reclaim_wake);
+        return -1;
+    }
+
+    return due;
+}
+
+// src[j] is where desktop j of m came from, or -1 if it is new.
+static void renumber_reclaim(const int *src, int m, long long now)
+{
+    long long *idle  = malloc(m * sizeof(idle[0]));
+    long long *total = malloc(m * sizeof(total[0]));
+    int active = -1, busy = INT_MAX;
+    for (int j = 0; j < m; j++) {
+        if (src[j] >= 0 && src[j] < reclaim_alloc) {
+            idle[j]  = idle_since[src[j]];
+            total[j] = reclaim_total[src[j]];
+        } else {
+            idle[j]  = now;
+            total[j] = 0;
+        }
+        if (src[j] >= 0 && src[j] == reclaim_active)
+            active = j;
+        if (src[j] >= 0 && src[j] == reclaim_busy)
+            busy = j;
+    }
+
+    // A desktop removed while being paged out has nothing left to credit.
+    if (reclaim_busy >= 0) {
+        if (busy == INT_MAX)
+            __atomic_store_n(&reclaim_cancel, 1, __ATOMIC_RELAXED);
+        reclaim_busy = busy;
+    }
+    reclaim_active = active;
+
+    free(idle_since);
+    free(reclaim_total);
+    idle_since    = idle;
+    reclaim_total = total;
+    reclaim_alloc = m;
+}
+
+long long daemon_reclaimed(int desktop)
+{
+    if (!dpy || opts.reclaim_s <= 0)
+        return -1;
+    return (desktop >= 0 && desktop < reclaim_alloc ?
+            reclaim_total[desktop] : 0);
+}
+
+int daemon_running(void)
+{
+    return dpy != NULL;
+}
+
+pstree_node_t *daemon_pstree(void)
+{
+    if (!dpy)
+        return NULL;
+
+    // Keep only the newest finished tree; older ones go back to the pstree
+    // thread to be freed so the X thread never pays for it.
+    pstree_node_t *tree;
+    while ((tree = ringq_pop(&trees)) != NULL) {
+        if (cur_tree && !ringq_push(&retired, cur_tree))
+            pstree_free(cur_tree);
+        cur_tree = tree;
+    }
+
+    return cur_tree;
+}
+
+int daemon_send(char **args, int flags)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!daemon_runtime_path(addr.sun_path, sizeof(addr.sun_path), ".sock"))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Our terminal goes to whoever is listening, so it had better be us.
+    if (!peer_is_us(fd)) {
+        fprintf(stderr, "Ignoring daemon socket %s: owned by another user\n",
+                addr.sun_path);
+        close(fd);
+        return -1;
+    }
+
+    // Request: one flags byte followed by NUL-terminated arguments, with
+    // our stdout and stderr attached to the first byte. An empty request is
+    // just a ping.
+    char buf[DAEMON_MAX_REQUEST];
+    size_t len = 0;
+    if (args) {
+        buf[len++] = flags;
+        for (; *args; args++) {
+            size_t n = strlen(*args) + 1;
+            if (len + n > sizeof(buf)) {
+                fprintf(stderr, "Command line too long for daemon\n");
+                close(fd);
+                return 1;
+            }
+            memcpy(buf + len, *args, n);
+            len += n;
+        }
+    }
+
+    for (size_t off = 0; off < len;) {
+        ssize_t n;
+        if (off == 0) {
+            int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+            union {
+                struct cmsghdr hdr;
+                char buf[CMSG_SPACE(sizeof(fds))];
+            } ctl;
+            struct iovec iov = { .iov_base = buf, .iov_len = len };
+            struct msghdr msg = {
+                .msg_iov = &iov, .msg_iovlen = 1,
+                .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf),
+            };
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type  = SCM_RIGHTS;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+            fflush(stdout);
+            n = sendmsg(fd, &msg, 0);
+        } else {
+            n = write(fd, buf + off, len - off);
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    unsigned char status;
+    ssize_t n;
+    while ((n = read(fd, &status, 1)) < 0 && errno == EINTR)
+        ;
+    close(fd);
+
+    return n == 1 ? status : -1;
+}
+
+static void *executor_main(void *arg)
+{
+    static char bufs[DAEMON_EXECUTORS][DAEMON_MAX_REQUEST];
+    static int next_buf = 0;
+    char *buf = bufs[__atomic_fetch_add(&next_buf, 1, __ATOMIC_RELAXED)];
+
+    job_t job;
+    sem_init(&job.done, 0, 0);
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        if (!peer_is_us(fd)) {
+            close(fd);
+            continue;
+        }
+
+        // Don't let a stalled client pin this executor.
+        struct timeval tv = { .tv_sec = 1 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        // The first read picks up the client's stdout and stderr.
+        job.out_fd = job.err_fd = -1;
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(2 * sizeof(int))];
+        } ctl;
+        struct iovec iov = {
+            .iov_base = buf, .iov_len = DAEMON_MAX_REQUEST - 1,
+        };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf),
+        };
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        size_t len = (n > 0 ? n : 0);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (n > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+            int fds[2];
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            job.out_fd = fds[0];
+            job.err_fd = fds[1];
+        }
+
+        while (n > 0 && len < DAEMON_MAX_REQUEST - 1 &&
+               (n = read(fd, buf + len, DAEMON_MAX_REQUEST - 1 - len)) > 0)
+            len += n;
+        buf[len] = '\0';
+
+        unsigned char status = 0;
+        if (len > 0) {
+            // Split the arguments in place.
+            int argc = 0;
+            job.flags = buf[0];
+            for (size_t i = 1; i < len && argc < DAEMON_MAX_ARGS;) {
+                job.args[argc++] = buf + i;
+                i += strlen(buf + i) + 1;
+            }
+            job.args[argc] = NULL;
+
+            if (argc == 0) {
+                status = 1;
+            } else if (!ringq_push(&jobs, &job)) {
+                fprintf(stderr, "Daemon busy; dropping command %s\n",
+                        job.args[0]);
+                status = 1;
+            } else {
+                wake(jobs_wake);
+                while (sem_wait(&job.done) < 0 && errno == EINTR)
+                    ;
+                status = job.status;
+            }
+        }
+
+        if (write(fd, &status, 1) < 0 && verbose)
+            perror("Replying to client");
+        close(fd);
+        if (job.out_fd >= 0)
+            close(job.out_fd);
+        if (job.err_fd >= 0)
+            close(job.err_fd);
+    }
+
+    return NULL;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void *pstree_main(void *arg)
+{
+    struct pollfd pfd = { .fd = pstree_wake, .events = POLLIN };
+    long long last = 0;
+
+    while (1) {
+        pstree_node_t *old;
+        while ((old = ringq_pop(&retired)) != NULL)
+            pstree_free(old);
+
+        // Coalesce every refresh request made since the last scan.
+        int requested = 0;
+        while (ringq_pop(&refresh))
+            requested = 1;
+
+        long long now = now_ms();
+        long long due = last + (requested ? PSTREE_MIN_MS : PSTREE_INTERVAL_MS);
+        if (now < due) {
+            poll(&pfd, 1, due - now);
+            drain_wake(pstree_wake);
+            if (requested)
+                ringq_push(&refresh, (void*)1);
+            continue;
+        }
+
+        last = now;
+        // Trees are only taken when needed, so when the queue is full the
+        // oldest waiting tree makes way; the newest is always published.
+        pstree_node_t *tree = pstree_create();
+        while (tree && !ringq_push(&trees, tree)) {
+            if ((old = ringq_pop(&trees)) != NULL)
+                pstree_free(old);
+        }
+    }
+
+    return NULL;
+}
+
+static void *reclaim_main(void *arg)
+{
+    struct pollfd pfd = { .fd = reclaim_wake, .events = POLLIN };
+
+    // Paging out is never urgent, and must not compete with the desktop
+    // in use.
+    reclaim_lower_priority();
+
+    while (1) {
+        reclaim_job_t *job = ringq_pop(&reclaims);
+        if (!job) {
+            poll(&pfd, 1, -1);
+            drain_wake(reclaim_wake);
+            continue;
+        }
+
+        for (int i = 0; i < job->num_procs; i++) {
+            if (__atomic_load_n(&reclaim_cancel, __ATOMIC_RELAXED))
+                break;
+            long long bytes = reclaim_process(job->procs[i].pid,
+                                              job->procs[i].starttime,
+                                              RECLAIM_RATE, &reclaim_cancel);
+            if (bytes < 0) {
+                job->error = errno;
+                break;
+            }
+            job->bytes += bytes;
+        }
+
+        // Only one job is out at a time, so there is always room.
+        ringq_push(&reclaimed, job);
+        wake(jobs_wake);
+    }
+
+    return NULL;
+}
+
+static void wake(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd");
+}
+
+// Open a stream on a copy of a client's fd, which its executor closes.
+// Returns NULL if fd is -1 or the stream can't be opened.
+static FILE *open_stream(int fd)
+{
+    if (fd < 0)
+        return NULL;
+
+    int copy = dup(fd);
+    if (copy < 0)
+        return NULL;
+    FILE *f = fdopen(copy, "w");
+    if (!f)
+        close(copy);
+    return f;
+}
+
+static void drain_wake(int fd)
+{
+    uint64_t val;
+    while (read(fd, &val, sizeof(val)) > 0)
+        ;
+}
+
+int daemon_runtime_path(char *buf, size_t len, const char *suffix)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char display[64];
+    int n;
+
+    // Display names may contain slashes (e.g. launchd sockets).
+    snprintf(display, sizeof(display), "%s", XDisplayName(NULL));
+    for (char *c = display; *c; c++)
+        if (*c == '/')
+            *c = '_';
+
+    if (dir && dir[0]) {
+        n = snprintf(buf, len, "%s/vtabs-%s%s", dir, display, suffix);
+    } else {
+        // /tmp is shared, so use a directory only we can get into, and make
+        // sure it wasn't planted by someone else.
+        char priv[64];
+        struct stat st;
+        snprintf(priv, sizeof(priv), "/tmp/vtabs-%d", (int)getuid());
+        if (mkdir(priv, 0700) < 0 && errno != EEXIST)
+            return 0;
+        if (lstat(priv, &st) < 0 || !S_ISDIR(st.st_mode) ||
+                st.st_uid != getuid() || (st.st_mode & 077)) {
+            fprintf(stderr, "Not using %s: not a private directory\n", priv);
+            return 0;
+        }
+        n = snprintf(buf, len, "%s/%s%s", priv, display, suffix);
+    }
+
+    return n >= 0 && n < len;
+}
+
+// Whether the other end of a Unix socket runs as our user.
+static int peer_is_us(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           cred.uid == getuid();
+}
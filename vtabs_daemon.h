@@ -0,0 +1,64 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef VTABS_DAEMON_H
+#define VTABS_DAEMON_H
+
+#include "pstree.h"
+#include <X11/Xlib.h>
+
+// The daemon splits work across threads so that none of them can stall the
+// others:
+//  - the X thread owns the Display. It drains events into the x11 state
+//    mirror and runs queued commands, since those are just X requests.
+//  - executor threads accept client connections, read and queue commands,
+//    and wait for the result, so a slow client never touches the X thread.
+//  - the pstree thread rescans /proc in the background and hands finished
+//    trees to the X thread.
+//  - the reclaim thread, if enabled, pages out the memory of desktops that
+//    have been idle for a while, at idle scheduling priority.
+// Threads talk only through bounded lock-free queues plus eventfd wakeups.
+
+// Flags sent along with a forwarded command line.
+#define DAEMON_VERBOSE   0x01
+#define DAEMON_NO_ACTION 0x02
+
+// Runs a command line on the X thread. Returns 1 on success, 0 on failure;
+// it must not exit.
+typedef int (*daemon_exec_fn)(char **args);
+
+typedef struct {
+    int dynamic;        // maintain dynamic desktops (see x11_update_dynamic)
+    int coalesce_ms;    // merge relative switches queued within this window
+    int confirm_ms;     // how long commands wait for the window manager
+    const char *cgroup; // place desktops in leaves of this cgroup, or NULL
+    int freeze;         // freeze the leaves of inactive desktops
+    int reclaim_s;      // page out desktops idle this long, or 0
+} daemon_opts_t;
+
+// Serve commands until SIGINT, SIGTERM or SIGHUP arrives, then thaw any
+// frozen desktops and return 1. Returns 0 if setup or the event loop fails,
+// having thawed what it could.
+int daemon_run(Display *dpy, daemon_exec_fn exec, const daemon_opts_t *opts);
+
+// Send a command line to a running daemon. Returns the command's exit status,
+// or -1 if no daemon is listening.
+int daemon_send(char **args, int flags);
+
+// Path of a per-user, per-display file: $XDG_RUNTIME_DIR/vtabs-<display>
+// followed by suffix, or /tmp/vtabs-<uid>/<display> and suffix without
+// XDG_RUNTIME_DIR. That directory is created private, and refused if it is
+// anything else. Returns 0 if there is no such directory or the path
+// doesn't fit in len.
+int daemon_runtime_path(char *buf, size_t len, const char *suffix);
+
+// Whether commands are being run by the daemon, on its X thread.
+int daemon_running(void);
+
+// Latest process tree from the pstree thread, or NULL if none has been built
+// yet. Only valid on the X thread, until it next returns to its event loop.
+pstree_node_t *daemon_pstree(void);
+
+// Bytes paged out of a desktop's processes since the daemon started, or -1
+// if reclaim isn't enabled. Only valid on the X thread.
+long long daemon_reclaimed(int desktop);
+
+#endif
@@ -0,0 +1,165 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#define _GNU_SOURCE     // SCHED_IDLE
+#include "vtabs_reclaim.h"
+#include "pstree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifndef SYS_pidfd_open
+# define SYS_pidfd_open      434
+#endif
+#ifndef SYS_process_madvise
+# define SYS_process_madvise 440
+#endif
+#ifndef MADV_PAGEOUT
+# define MADV_PAGEOUT        21
+#endif
+
+// Each process_madvise call covers at most this much address space in at
+// most this many ranges; the rate limit and cancellation are checked in
+// between.
+#define RECLAIM_CHUNK (32L << 20)
+#define RECLAIM_IOV   64
+
+static int read_ranges(int pid, struct iovec **ranges, int *alloc);
+
+long long reclaim_process(int pid, unsigned long long starttime,
+                          long long rate, const int *cancel)
+{
+    // Only the reclaim thread calls this, so the range list is reused.
+    static struct iovec *ranges = NULL;
+    static int ranges_alloc = 0;
+    static long page_size = 0;
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0)
+        return errno == ESRCH ? 0 : -1;
+
+    // The pid may have been reused since it was attributed. The pidfd pins
+    // whatever process has it now, so a start time that still matches
+    // means the pidfd refers to the one we were given.
+    pstree_stat_t st;
+    if (!pstree_read_stat(pid, &st) || st.starttime != starttime) {
+        close(pidfd);
+        return 0;
+    }
+
+    int n = read_ranges(pid, &ranges, &ranges_alloc);
+    if (n <= 0) {
+        close(pidfd);
+        return 0;
+    }
+
+    unsigned long rss = st.rss;
+    long long total = 0;
+    int r = 0;
+    size_t off = 0;     // progress into ranges[r]
+
+    while (r < n && !__atomic_load_n(cancel, __ATOMIC_RELAXED)) {
+        struct iovec iov[RECLAIM_IOV];
+        int k = 0;
+        size_t len = 0;
+        while (r < n && k < RECLAIM_IOV && len < RECLAIM_CHUNK) {
+            size_t take = ranges[r].iov_len - off;
+            if (take > RECLAIM_CHUNK - len)
+                take = RECLAIM_CHUNK - len;
+            iov[k].iov_base = (char*)ranges[r].iov_base + off;
+            iov[k].iov_len  = take;
+            k++;
+            len += take;
+            off += take;
+            if (off == ranges[r].iov_len) {
+                r++;
+                off = 0;
+            }
+        }
+
+        // ENOMEM means part of the chunk was unmapped since maps was read.
+        if (syscall(SYS_process_madvise, pidfd, iov, k, MADV_PAGEOUT, 0) < 0) {
+            if (errno == ESRCH)
+                break;
+            if (errno != ENOMEM) {
+                int err = errno;
+                close(pidfd);
+                errno = err;
+                return -1;
+            }
+        }
+
+        // Pace by what actually left memory rather than by address space
+        // covered, which is mostly untouched reservations in some programs.
+        if (!pstree_read_stat(pid, &st))
+            break;
+        if (st.rss < rss) {
+            long long bytes = (long long)(rss - st.rss) * page_size;
+            long long ns = bytes * 1000000000LL / rate;
+            struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+            total += bytes;
+            nanosleep(&ts, NULL);
+        }
+        rss = st.rss;
+    }
+
+    close(pidfd);
+    return total;
+}
+
+void reclaim_lower_priority(void)
+{
+    // On Linux, this applies to the calling thread only.
+    struct sched_param param = { 0 };
+    if (sched_setscheduler(0, SCHED_IDLE, &param) < 0)
+        perror("SCHED_IDLE");
+}
+
+// Collect the private anonymous mappings of a process. Returns how many
+// there are, or -1 if its maps can't be read.
+static int read_ranges(int pid, struct iovec **ranges, int *alloc)
+{
+    char line[512];
+    sprintf(line, "/proc/%d/maps", pid);
+    FILE *f = fopen(line, "re");
+    if (!f)
+        return -1;
+
+    int n = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end, inode;
+        char perms[5];
+        int pos = 0;
+        if (sscanf(line, "%lx-%lx %4s %*x %*x:%*x %lu %n",
+                   &start, &end, perms, &inode, &pos) < 4 || !pos)
+            continue;
+
+        // Guard pages have no access and so nothing to page out; [vdso]
+        // and friends belong to the kernel.
+        char *path = line + pos;
+        path[strcspn(path, "\n")] = '\0';
+        if (inode != 0 || perms[3] != 'p' || strncmp(perms, "---", 3) == 0)
+            continue;
+        if (path[0] && strcmp(path, "[heap]") != 0 &&
+                strcmp(path, "[stack]") != 0 && strncmp(path, "[anon:", 6) != 0)
+            continue;
+
+        if (n == *alloc) {
+            *alloc = (*alloc ? 2 * *alloc : 256);
+            *ranges = realloc(*ranges, *alloc * sizeof(**ranges));
+        }
+        (*ranges)[n].iov_base = (void*)start;
+        (*ranges)[n].iov_len  = end - start;
+        n++;
+    }
+
+    fclose(f);
+    return n;
+}
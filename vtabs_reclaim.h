@@ -0,0 +1,25 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef VTABS_RECLAIM_H
+#define VTABS_RECLAIM_H
+
+// Paging out the memory of processes nobody is looking at, so that the
+// desktop in use doesn't have to swap. Only private anonymous mappings
+// (heap, stacks, and anonymous mmaps) are advised with MADV_PAGEOUT through
+// process_madvise and a pidfd; file-backed pages are left to the kernel,
+// which can drop them cheaply when it needs to.
+//
+// Advising another process needs Linux 5.10 or later and CAP_SYS_NICE.
+
+// Page out a process's anonymous memory a chunk at a time, sleeping after
+// each chunk so that no more than rate bytes a second leave memory, and
+// stopping early once *cancel is set. The process is skipped unless its
+// start time is still starttime. Returns the drop in the process's
+// resident set, or -1 with errno set if process_madvise can't be used at
+// all. A process that exits along the way isn't an error.
+long long reclaim_process(int pid, unsigned long long starttime,
+                          long long rate, const int *cancel);
+
+// Run the calling thread only when nothing else wants the CPU.
+void reclaim_lower_priority(void);
+
+#endif
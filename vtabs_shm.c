@@ -0,0 +1,86 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "vtabs_shm.h"
+#include "vtabs_x11.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern FILE *cmd_out, *cmd_err;
+
+static vtabs_shm_t *shm = NULL;
+
+int shm_init(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(cmd_err, "%s: %s\n", name, strerror(errno));
+        return 0;
+    }
+
+    if (ftruncate(fd, sizeof(*shm)) < 0) {
+        fprintf(cmd_err, "%s: %s\n", name, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        fprintf(cmd_err, "%s: %s\n", name, strerror(errno));
+        shm = NULL;
+        return 0;
+    }
+
+    // A previous writer may have died mid-update; start from an even count
+    // so readers aren't left spinning.
+    shm->seq &= ~1u;
+    shm->version = VTABS_SHM_VERSION;
+    __atomic_store_n(&shm->magic, VTABS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+void shm_publish(void)
+{
+    if (!shm)
+        return;
+
+    // Enter the write side of the seqlock. The release fence keeps the
+    // payload stores below from being reordered before the odd seq.
+    uint32_t seq = shm->seq;
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    int n = x11_num_desktops;
+    if (n > VTABS_SHM_MAX_DESKTOPS)
+        n = VTABS_SHM_MAX_DESKTOPS;
+
+    shm->active_desktop = x11_active_desktop;
+    shm->num_desktops   = n;
+    shm->sticky_windows = x11_count_windows(-1);
+    for (int i = 0; i < n; i++)
+        shm->window_counts[i] = x11_count_windows(i);
+
+    // Names are packed back to back like _NET_DESKTOP_NAMES. Names that
+    // don't fit are dropped rather than truncated.
+    size_t used = 0;
+    uint32_t num_names = 0;
+    for (int i = 0; i < n; i++) {
+        const char *name = x11_get_desktop_name(i);
+        if (!name)
+            break;
+        size_t len = strlen(name) + 1;
+        if (used + len > sizeof(shm->names))
+            break;
+        memcpy(shm->names + used, name, len);
+        used += len;
+        num_names++;
+    }
+    shm->num_names = num_names;
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
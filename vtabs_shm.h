@@ -0,0 +1,60 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef VTABS_SHM_H
+#define VTABS_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Desktop state published to a POSIX shared memory segment for status bars
+// and pagers. The segment is guarded by a seqlock: the writer bumps seq to an
+// odd value before it touches the payload and back to an even value after, so
+// a reader that sees the same even value before and after copying the payload
+// has a consistent snapshot. Readers never block the writer and need no
+// syscalls beyond the initial shm_open/mmap.
+
+#define VTABS_SHM_MAGIC        0x76746162   // "vtab"
+#define VTABS_SHM_VERSION      1
+#define VTABS_SHM_MAX_DESKTOPS 1024
+#define VTABS_SHM_NAMES_SIZE   16384
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;             // odd while an update is in progress
+    uint32_t active_desktop;
+    uint32_t num_desktops;
+    uint32_t num_names;       // number of NUL-terminated strings in names
+    uint32_t sticky_windows;  // windows on all desktops
+    uint32_t window_counts[VTABS_SHM_MAX_DESKTOPS];
+    char     names[VTABS_SHM_NAMES_SIZE];
+} vtabs_shm_t;
+
+// Create (or reuse) the named segment and map it for writing. The name is
+// passed to shm_open, so it should look like "/vtabs". Returns 0 on failure.
+int shm_init(const char *name);
+
+// Copy the current x11 state into the segment. Does nothing if shm_init
+// has not succeeded.
+void shm_publish(void);
+
+// Take a consistent snapshot of a mapped segment. Spins while a write is in
+// progress; returns 0 if the segment isn't a vtabs segment.
+static inline int vtabs_shm_read(const vtabs_shm_t *shm, vtabs_shm_t *out)
+{
+    if (shm->magic != VTABS_SHM_MAGIC || shm->version != VTABS_SHM_VERSION)
+        return 0;
+
+    uint32_t seq0, seq1;
+    do {
+        seq0 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq0 & 1)
+            continue;
+        memcpy(out, shm, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq1 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    } while ((seq0 & 1) || seq0 != seq1);
+
+    return 1;
+}
+
+#endif
@@ -0,0 +1,198 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "vtabs_stats.h"
+#include "vtabs_x11.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATS_SHARED (-1)
+
+// An attributed process. ticks is only meaningful once sampled.
+typedef struct {
+    int pid;
+    int desktop;                    // or STATS_SHARED
+    int sampled;
+    int first_tid;                  // its threads in tids, if listed
+    int num_tids;
+    unsigned long long starttime;   // tells a reused pid apart
+    unsigned long long ticks;       // utime + stime at the last sample
+} proc_t;
+
+// Sorted by pid. The spare array is where the next list is built.
+static proc_t  *procs = NULL, *spare = NULL;
+static int      num_procs   = 0;
+static int      num_spare   = 0;
+static int      procs_alloc = 0;
+
+// Thread IDs of the attributed processes, taken afresh from each tree.
+static int     *tids = NULL;
+static int      tids_used  = 0;
+static int      tids_alloc = 0;
+static int      with_threads = 0;
+
+static long long last_sample = -1;
+
+static void add_subtree(pstree_node_t *node, int desktop);
+static void add_proc(pstree_node_t *node, int pid, int desktop);
+static int  compare_procs(const void *a, const void *b);
+
+void stats_attribute(pstree_node_t *tree)
+{
+    const x11_owner_t *owners;
+    int num_owners = x11_get_owners(&owners);
+
+    // Walking down from each owner, and stopping at other owners, reaches
+    // every process below the owners exactly once.
+    num_spare = 0;
+    tids_used = 0;
+    with_threads = 0;
+    for (int i = 0; i < num_owners; i++) {
+        pstree_node_t *node = (tree ? pstree_find(tree, owners[i].pid) : NULL);
+        if (node)
+            add_subtree(node, owners[i].desktop);
+        else
+            add_proc(NULL, owners[i].pid, owners[i].desktop);
+    }
+    qsort(spare, num_spare, sizeof(spare[0]), compare_procs);
+
+    // Both lists are sorted, so carry counters over in one pass.
+    for (int i = 0, j = 0; i < num_spare; i++) {
+        while (j < num_procs && procs[j].pid < spare[i].pid)
+            j++;
+        if (j < num_procs && procs[j].pid == spare[i].pid) {
+            spare[i].sampled   = procs[j].sampled;
+            spare[i].starttime = procs[j].starttime;
+            spare[i].ticks     = procs[j].ticks;
+        }
+    }
+
+    proc_t *tmp = procs;
+    procs     = spare;
+    spare     = tmp;
+    num_procs = num_spare;
+}
+
+void stats_sample(stats_usage_t *usage, int count)
+{
+    static long hz = 0, page_size = 0;
+    if (!hz) {
+        hz = sysconf(_SC_CLK_TCK);
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+
+    memset(usage, 0, (count + 1) * sizeof(usage[0]));
+    for (int i = 0; i <= count; i++)
+        usage[i].running = (with_threads ? 0 : -1);
+
+    // Deltas are summed into cpu as ticks, then turned into a rate.
+    int kept = 0;
+    for (int i = 0; i < num_procs; i++) {
+        proc_t *p = &procs[i];
+        pstree_stat_t st;
+        if (!pstree_read_stat(p->pid, &st) ||
+                (p->sampled && st.starttime != p->starttime))
+            continue;
+
+        int row = p->desktop;
+        if (row < 0 || row >= count)
+            row = count;
+        stats_usage_t *u = &usage[row];
+
+        // A single thread's state is the process's own, and so is the best
+        // guess for a process whose threads the tree didn't list.
+        if (!with_threads) {
+        } else if (p->num_tids <= 1) {
+            u->running += (st.state == 'R');
+        } else {
+            for (int t = 0; t < p->num_tids; t++) {
+                pstree_stat_t tst;
+                if (pstree_read_task_stat(p->pid, tids[p->first_tid + t],
+                                          &tst))
+                    u->running += (tst.state == 'R');
+            }
+        }
+
+        unsigned long long ticks = st.utime + st.stime;
+        u->num_procs++;
+        u->num_threads += st.num_threads;
+        u->rss    += (unsigned long long)st.rss * page_size;
+        u->cpu_ms += ticks * 1000 / hz;
+        if (p->sampled && ticks >= p->ticks)
+            u->cpu += ticks - p->ticks;
+
+        p->sampled   = 1;
+        p->starttime = st.starttime;
+        p->ticks     = ticks;
+        procs[kept++] = *p;
+    }
+    num_procs = kept;
+
+    long long elapsed = (last_sample >= 0 ? now - last_sample : 0);
+    for (int i = 0; i <= count; i++)
+        usage[i].cpu = (elapsed > 0 ? usage[i].cpu * 1000 / hz / elapsed : -1);
+    last_sample = now;
+}
+
+int stats_procs(int desktop, stats_proc_t *out, int max)
+{
+    int n = 0;
+    for (int i = 0; i < num_procs; i++) {
+        proc_t *p = &procs[i];
+        if (p->desktop != desktop)
+            continue;
+        if (n < max) {
+            pstree_stat_t st;
+            if (!p->sampled)
+                p->starttime = (pstree_read_stat(p->pid, &st) ?
+                                st.starttime : 0);
+            out[n].pid       = p->pid;
+            out[n].starttime = p->starttime;
+        }
+        n++;
+    }
+    return n;
+}
+
+static void add_subtree(pstree_node_t *node, int desktop)
+{
+    add_proc(node, node->pid, desktop);
+    for (pstree_node_t *c = node->child; c; c = c->sibling) {
+        if (!x11_find_owner(c->pid))
+            add_subtree(c, desktop);
+    }
+}
+
+// node, if not NULL, is where to find the process's threads.
+static void add_proc(pstree_node_t *node, int pid, int desktop)
+{
+    if (num_spare == procs_alloc) {
+        procs_alloc = (procs_alloc ? 2 * procs_alloc : 256);
+        procs = realloc(procs, procs_alloc * sizeof(procs[0]));
+        spare = realloc(spare, procs_alloc * sizeof(spare[0]));
+    }
+    spare[num_spare] = (proc_t){ .pid = pid, .desktop = desktop };
+
+    if (node && node->threads) {
+        if (tids_used + node->num_threads > tids_alloc) {
+            tids_alloc = 2 * (tids_used + node->num_threads);
+            tids = realloc(tids, tids_alloc * sizeof(tids[0]));
+        }
+        spare[num_spare].first_tid = tids_used;
+        spare[num_spare].num_tids  = node->num_threads;
+        for (int i = 0; i < node->num_threads; i++)
+            tids[tids_used++] = node->threads[i].tid;
+        with_threads = 1;
+    }
+    num_spare++;
+}
+
+static int compare_procs(const void *a, const void *b)
+{
+    const proc_t *pa = a, *pb = b;
+    return (pa->pid > pb->pid) - (pa->pid < pb->pid);
+}
@@ -0,0 +1,52 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef VTABS_STATS_H
+#define VTABS_STATS_H
+
+#include "pstree.h"
+
+// Memory and CPU use per desktop. A process counts toward a desktop when the
+// nearest process above it (or itself) that owns windows has them all on
+// that desktop; owners with windows on several desktops, or sticky windows,
+// count toward a shared group. Each process is counted once, and processes
+// above the window owners, like the session manager, aren't counted at all.
+//
+// Attribution walks a process tree in memory; sampling then rereads only
+// /proc/<pid>/stat of the attributed processes, which holds both the CPU
+// times and the resident set size. If the tree lists threads, sampling also
+// rereads the stat of each thread it listed in processes with several.
+
+typedef struct {
+    int num_procs;
+    int num_threads;
+    int running;                // runnable threads, or -1 if not listed
+    unsigned long long rss;     // bytes
+    unsigned long long cpu_ms;  // CPU time of the processes so far
+    double cpu;                 // CPUs busy since the last sample, or -1
+} stats_usage_t;
+
+// Work out which processes count toward which desktop, from the window
+// mirror (which must have pids loaded) and tree, which may be NULL to count
+// only the window owners. Counters of processes that were already
+// attributed carry over, and threads are taken from tree if it has them.
+void stats_attribute(pstree_node_t *tree);
+
+// Sample the attributed processes into usage[0] to usage[count - 1] for
+// desktops and usage[count] for the shared group. Processes that have
+// exited are dropped. Rates cover the time since the previous sample, and
+// only processes present in both.
+void stats_sample(stats_usage_t *usage, int count);
+
+// A process and its start time, which tells it apart from a later process
+// given the same pid.
+typedef struct {
+    int pid;
+    unsigned long long starttime;
+} stats_proc_t;
+
+// Copy up to max of the processes attributed to a desktop into procs. Start
+// times not known from a sample are read as the processes are copied, and
+// are 0 for any that have exited. Returns how many there are, which may be
+// more than max.
+int stats_procs(int desktop, stats_proc_t *procs, int max);
+
+#endif
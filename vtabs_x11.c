@@ -1,10 +1,18 @@
 /*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
 #include "vtabs_x11.h"
+#include "trace.h"
+#include "rules.h"
+#include "pstree.h"
+#include "vtabs_cache.h"
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 
 #ifdef HAVE_GETHOSTNAME
 # include <unistd.h>
@@ -12,6 +20,12 @@
 # include <sys/utsname.h>
 #endif
 
+// Build with -DHAVE_XRES and link with -lXRes to ask the server for pids.
+#ifdef HAVE_XRES
+# include <X11/extensions/XRes.h>
+# include <unistd.h>
+#endif
+
 static Display *dpy  = NULL;
 static Window   root = None;
 
@@ -21,12 +35,14 @@ static Atom _NET_DESKTOP_NAMES;
 static Atom _NET_CLIENT_LIST;
 static Atom _NET_WM_DESKTOP;
 static Atom _NET_WM_PID;
-
-#define X11_MAX_DESKTOPS 1024
+static Atom _NET_CLOSE_WINDOW;
+static Atom _NET_WM_NAME;
+static Atom WM_STATE;
 
 // declared in vtabs.c
 extern int verbose;
 extern int no_action;
+extern FILE *cmd_out, *cmd_err;
 
 // externed for read-only use in other files
 int x11_num_desktops      = 0;
@@ -36,35 +52,157 @@ static char*    desktop_names[X11_MAX_DESKTOPS];
 static uint32_t num_desktop_names = 0;
 
 static uint32_t x11_get_u32_prop(Window w, Atom atom);
-static void     x11_get_desktop_names(void);
+static int      x11_read_u32_prop(Window w, Atom atom, uint32_t *val);
+static int      x11_put_desktop_names(void);
+static char*    x11_get_text_prop(Window w, Atom atom);
+static uint32_t x11_get_pid(Window w);
+static void     x11_load_pids(uint32_t first, uint32_t count);
+static int      x11_xres_pids(uint32_t first, uint32_t count);
+static int      x11_get_desktop_names(void);
+
+// Whether the X-Resource extension can tell us client pids; -1 until the
+// first time pids are needed.
+static int xres_usable = -1;
 
 typedef struct {
     Window   window;
     uint32_t pid;     // 0 if unknown / not on localhost
     uint32_t desktop; // 0xffffffff means sticky or unknown
+    int32_t  next;    // index of next window in the same bucket, or -1
+    int32_t  prev;    // index of previous window in the same bucket, or -1
+    uint8_t  pending; // placement attempts left for a new window, or 0
+    uint8_t  managed; // in _NET_CLIENT_LIST or has _NET_WM_DESKTOP
+    int32_t  track;   // index of the window's tracked request, or -1
 } wininfo_t;
 
+// Whether new windows are checked against placement rules.
+static int place_windows = 0;
+
+// A window that is never mapped, and matches no rule, would otherwise be
+// checked again on every title change for as long as it lives.
+#define PLACE_TRIES 8
+
 // The window list is totally unordered, and may be realloced.
 static wininfo_t *win_list       = NULL;
 static uint32_t   win_list_size  = 0;
 static uint32_t   win_list_alloc = 0;
 
-static wininfo_t *win_list_add(Window window);
+static wininfo_t *win_list_add(Window window, int managed);
 static int win_list_remove(wininfo_t *window);
 static wininfo_t *win_list_get(Window window);
 
+// Window IDs are also indexed, so events find their window in constant time.
+// The index uses open addressing with linear probing; slots hold a win_list
+// index plus one, so zero means free. It has twice the capacity of win_list
+// and is rebuilt whenever win_list grows.
+static int32_t  *win_index      = NULL;
+static uint32_t  win_index_mask = 0;
+
+static int32_t *win_index_slot(Window window);
+static void     win_index_remove(Window window);
+
+// Windows are also threaded onto one list per desktop, so that desktop-scoped
+// operations only visit that desktop's windows. Links are indices rather
+// than pointers since win_list moves. Sticky windows, and any with a desktop
+// out of range, share the last bucket.
+#define X11_STICKY_BUCKET X11_MAX_DESKTOPS
+
+static int32_t  desk_head[X11_MAX_DESKTOPS + 1];
+static uint32_t desk_count[X11_MAX_DESKTOPS + 1];
+
+// Set whenever a desktop becomes empty or stops being empty.
+static int occupancy_changed = 0;
+
+// Where each desktop came from, across every renumbering since the last
+// x11_take_renumbering; num_renumbered is 0 if there were none.
+static int renumbered[X11_MAX_DESKTOPS];
+static int num_renumbered = 0;
+
+static int  bucket_of(uint32_t desktop);
+static void bucket_link(int32_t index);
+static void bucket_unlink(int32_t index);
+static void win_set_desktop(wininfo_t *w, uint32_t desktop);
+static int  x11_place_window(wininfo_t *w);
+
+// What has been loaded so far; see x11_require.
+static int loaded = 0;
+
+// Requests whose effect we wait to see. Each is confirmed by the property
+// change it should cause, or fails with an X error matched by its serial,
+// or because its window went away. Entries are appended in serial order,
+// and each window (or, for desktop-wide requests, each kind) points at its
+// newest one, so events find theirs in constant time.
+#define TRACK_MOVE      0   // window's _NET_WM_DESKTOP becomes value
+#define TRACK_CLOSE     1   // window is destroyed
+#define TRACK_COUNT     2   // _NET_NUMBER_OF_DESKTOPS becomes value
+#define TRACK_ACTIVE    3   // _NET_CURRENT_DESKTOP becomes value
+#define TRACK_NAMES     4   // _NET_DESKTOP_NAMES is rewritten
+#define TRACK_KINDS     5
+
+#define TRACK_PENDING   0
+#define TRACK_DONE      1
+#define TRACK_FAILED    2
+
+typedef struct {
+    unsigned long serial;
+    Window        window;   // root for desktop-wide requests
+    uint8_t       kind;
+    uint8_t       state;
+    uint32_t      value;
+    char          error[80];
+} track_t;
+
+static track_t *tracks         = NULL;
+static int      num_tracks     = 0;
+static int      tracks_alloc   = 0;
+static int      tracks_pending = 0;
+static int32_t  root_track[TRACK_KINDS] = { -1, -1, -1, -1, -1 };
+
+static void track_request(int kind, Window window, uint32_t value);
+static void track_resolve(int32_t index, int state, const char *error);
+static int  x11_error_handler(Display *dpy, XErrorEvent *err);
+
 int x11_init(Display *_dpy, Window _root)
 {
     dpy  = _dpy;
     root = _root;
 
-    // Cache atoms we'll need later.
-    _NET_NUMBER_OF_DESKTOPS = XInternAtom(dpy, "_NET_NUMBER_OF_DESKTOPS", 0);
-    _NET_CURRENT_DESKTOP    = XInternAtom(dpy, "_NET_CURRENT_DESKTOP", 0);
-    _NET_DESKTOP_NAMES      = XInternAtom(dpy, "_NET_DESKTOP_NAMES", 0);
-    _NET_CLIENT_LIST        = XInternAtom(dpy, "_NET_CLIENT_LIST", 0);
-    _NET_WM_DESKTOP         = XInternAtom(dpy, "_NET_WM_DESKTOP", 0);
-    _NET_WM_PID             = XInternAtom(dpy, "_NET_WM_PID", 0);
+    for (int i = 0; i <= X11_STICKY_BUCKET; i++)
+        desk_head[i] = -1;
+
+    // Windows vanish all the time, so a BadWindow must not be fatal.
+    XSetErrorHandler(x11_error_handler);
+
+    // Cache atoms we'll need later, in a single round trip.
+    static struct {
+        Atom       *atom;
+        const char *name;
+    } atoms[] = {
+        { &_NET_NUMBER_OF_DESKTOPS, "_NET_NUMBER_OF_DESKTOPS" },
+        { &_NET_CURRENT_DESKTOP,    "_NET_CURRENT_DESKTOP"    },
+        { &_NET_DESKTOP_NAMES,      "_NET_DESKTOP_NAMES"      },
+        { &_NET_CLIENT_LIST,        "_NET_CLIENT_LIST"        },
+        { &_NET_WM_DESKTOP,         "_NET_WM_DESKTOP"         },
+        { &_NET_WM_PID,             "_NET_WM_PID"             },
+        { &_NET_CLOSE_WINDOW,       "_NET_CLOSE_WINDOW"       },
+        { &_NET_WM_NAME,            "_NET_WM_NAME"            },
+        { &WM_STATE,                "WM_STATE"                },
+    };
+    enum { NUM_ATOMS = sizeof(atoms) / sizeof(atoms[0]) };
+    char *names[NUM_ATOMS];
+    Atom  vals[NUM_ATOMS];
+    for (int i = 0; i < NUM_ATOMS; i++)
+        names[i] = (char*)atoms[i].name;
+
+    trace_begin("intern atoms");
+    Status status = XInternAtoms(dpy, names, NUM_ATOMS, 0, vals);
+    trace_end();
+    if (!status) {
+        fprintf(cmd_err, "Failed to intern atoms\n");
+        return 0;
+    }
+    for (int i = 0; i < NUM_ATOMS; i++)
+        *atoms[i].atom = vals[i];
     
     // Setup event listening on the root window so we can be pushed relevant
     // events.
@@ -72,30 +210,68 @@ int x11_init(Display *_dpy, Window _root)
                             StructureNotifyMask    |
                             PropertyChangeMask);
 
-    // Query for the initial state.
+    // Query for the initial state. Everything else is loaded on first use.
+    trace_begin("query desktops");
     x11_num_desktops   = x11_get_u32_prop(root, _NET_NUMBER_OF_DESKTOPS);
     x11_active_desktop = x11_get_u32_prop(root, _NET_CURRENT_DESKTOP);
-    x11_get_desktop_names();
+    trace_end();
 
-    // Add all existing windows. 
-    // TODO: there is a race here, in that by the time we get around to 
-    // querying for the window properties, it may already be gone. 
-    Atom ret_type;
-    int ret_fmt;
-    unsigned long ret_n;
-    unsigned long bytes_after;
-    unsigned char *val;
-    if (XGetWindowProperty(dpy, root, _NET_CLIENT_LIST, 0, (1 << 20), 0, 
-                AnyPropertyType, &ret_type, &ret_fmt, &ret_n, &bytes_after, 
-                &val) != Success) {
-        fprintf(stderr, "Failed to retrieve client list\n");
-        return 0;
+    return 1;
+}
+
+int x11_require(int what)
+{
+    if ((what & X11_NEED_NAMES) && !(loaded & X11_NEED_NAMES)) {
+        trace_begin("load names");
+        int ok = x11_get_desktop_names();
+        trace_end();
+        if (!ok) {
+            fprintf(cmd_err, "Failed to retrieve desktop names\n");
+            return 0;
+        }
+        loaded |= X11_NEED_NAMES;
     }
-    
-    for (int i = 0; i < ret_n; i++)
-        win_list_add(((Window*)val)[i]);
 
-    XFree(val);
+    if ((what & (X11_NEED_WINDOWS | X11_NEED_PIDS)) && 
+            !(loaded & X11_NEED_WINDOWS)) {
+        // Add all existing windows. 
+        // TODO: there is a race here, in that by the time we get around to 
+        // querying for the window properties, it may already be gone. 
+        Atom ret_type;
+        int ret_fmt;
+        unsigned long ret_n;
+        unsigned long bytes_after;
+        unsigned char *val;
+        trace_begin("XGetWindowProperty");
+        int status = XGetWindowProperty(dpy, root, _NET_CLIENT_LIST, 0, 
+                    (1 << 20), 0, AnyPropertyType, &ret_type, &ret_fmt, 
+                    &ret_n, &bytes_after, &val);
+        trace_end();
+        if (status != Success) {
+            fprintf(cmd_err, "Failed to retrieve client list\n");
+            return 0;
+        }
+        
+        trace_begin("load windows");
+        cache_prune((unsigned long*)val, ret_n);
+        for (int i = 0; i < ret_n; i++)
+            win_list_add(((Window*)val)[i], 1);
+        trace_end();
+
+        XFree(val);
+        loaded |= X11_NEED_WINDOWS;
+    }
+
+    // Pids cost a round trip, or without the X-Resource extension one or
+    // two per window, so they are only fetched once somebody asks, and for
+    // every window loaded so far at once. From then on win_list_add fetches
+    // them for windows as they are created.
+    if ((what & X11_NEED_PIDS) && !(loaded & X11_NEED_PIDS)) {
+        loaded |= X11_NEED_PIDS;
+        trace_begin("load pids");
+        x11_load_pids(0, win_list_size);
+        trace_end();
+    }
 
     return 1;
 }
@@ -104,16 +280,44 @@ static int x11_handle_property_event(XPropertyEvent *ev);
 
 int x11_handle_event(XEvent *ev)
 {
-    // Return 1 if the event was handled. 
-    // (TODO: maybe change this to return whether redraw is needed)
+    // Return a mask of X11_CHANGED_* flags, or 0 if nothing changed.
 
     switch (ev->type) {
         case PropertyNotify:
             return x11_handle_property_event((XPropertyEvent*)ev);
-        case CreateNotify: 
-            return win_list_add(ev->xany.window) != NULL;
-        case DestroyNotify:
-            return win_list_remove(win_list_get(ev->xany.window));
+        case CreateNotify: {
+            // Until the window list is loaded there is nothing to update;
+            // loading it later picks up the new window. Windows created
+            // while it loaded may already be in it.
+            if (!(loaded & X11_NEED_WINDOWS) ||
+                    win_list_get(ev->xcreatewindow.window))
+                return 0;
+            wininfo_t *w = win_list_add(ev->xcreatewindow.window, 0);
+            if (w == NULL)
+                return 0;
+
+            // Clients usually set their class and title after creating the
+            // window, so placement is retried as those arrive, until the
+            // window manager takes the window over or PLACE_TRIES run out.
+            if (place_windows && rules_count() > 0 &&
+                    !ev->xcreatewindow.override_redirect) {
+                w->pending = PLACE_TRIES;
+                x11_place_window(w);
+            }
+            return X11_CHANGED_CREATED;
+        }
+        case DestroyNotify: {
+            cache_forget(ev->xdestroywindow.window);
+            wininfo_t *w = win_list_get(ev->xdestroywindow.window);
+            if (w && w->track >= 0) {
+                int closed = (tracks[w->track].kind == TRACK_CLOSE);
+                track_resolve(w->track, closed ? TRACK_DONE : TRACK_FAILED,
+                              "the window went away");
+            }
+            if (!win_list_remove(w))
+                return 0;
+            return X11_CHANGED_DESTROYED;
+        }
         case MapNotify:
         case UnmapNotify:
         default: return 0;
@@ -122,6 +326,9 @@ int x11_handle_event(XEvent *ev)
 
 const char* x11_get_desktop_name(int index)
 {
+    if (!x11_require(X11_NEED_NAMES))
+        return NULL;
+
     if (index < 0 || index >= num_desktop_names)
         return NULL;
 
@@ -130,8 +337,13 @@ const char* x11_get_desktop_name(int index)
 
 int x11_set_desktop_name(int index, const char *new_name)
 {
+    // The whole list is written back, so it has to be current.
+    if (!x11_require(X11_NEED_NAMES))
+        return 0;
+
     if (index < 0 || index >= x11_num_desktops) {
-        fprintf(stderr, "Can't rename desktop %d; index out of range\n", index);
+        fprintf(cmd_err, "Can't rename desktop %d; index out of range\n",
+                index);
         return 0;
     }
 
@@ -159,13 +371,18 @@ int x11_set_desktop_name(int index, const char *new_name)
 
     // Now that we've updated our internal state, update the property on the 
     // window manager's side. 
+    return x11_put_desktop_names();
+}
 
+static int x11_put_desktop_names(void)
+{
     XTextProperty prop;
     if (!XStringListToTextProperty(desktop_names, num_desktop_names, &prop)) {
-        fprintf(stderr, "XStringListToTextProperty failed\n");
+        fprintf(cmd_err, "XStringListToTextProperty failed\n");
         return 0;
     }
 
+    track_request(TRACK_NAMES, root, 0);
     XSetTextProperty(dpy, root, &prop, _NET_DESKTOP_NAMES);
     XFree(prop.value);
 
@@ -174,18 +391,174 @@ int x11_set_desktop_name(int index, const char *new_name)
 
 static int x11_client_message(Window win, Atom type, long l0, long l1);
 
+int x11_remap_desktops(const int *map, const int *src, int count, int active)
+{
+    if (!x11_require(X11_NEED_WINDOWS | X11_NEED_NAMES))
+        return 0;
+
+    int old_count = x11_num_desktops;
+
+    if (count < 1 || count > X11_MAX_DESKTOPS) {
+        fprintf(cmd_err, "Invalid desktop count: %d\n", count);
+        return 0;
+    }
+
+    // Desktops can only be added at the end, so make room first.
+    if (count > old_count && !x11_set_num_desktops(count))
+        return 0;
+
+    // Collect every move before sending any, so that pretend moves in
+    // no_action mode can't be picked up twice.
+    int32_t *moves = malloc(win_list_size * sizeof(moves[0]));
+    int32_t *dests = malloc(win_list_size * sizeof(dests[0]));
+    int num_moves = 0;
+    for (int i = 0; i < old_count; i++) {
+        if (map[i] == i)
+            continue;
+        for (int32_t w = desk_head[i]; w >= 0; w = win_list[w].next) {
+            moves[num_moves] = w;
+            dests[num_moves++] = map[i];
+        }
+    }
+
+    int ok = 1;
+    for (int i = 0; i < num_moves && ok; i++) {
+        wininfo_t *w = &win_list[moves[i]];
+
+        if (verbose) {
+            fprintf(cmd_out, "Moving window 0x%lx from %d to %d\n", 
+                    w->window, w->desktop, dests[i]);
+        }
+
+        if (no_action) {
+            // pretend it worked
+            win_set_desktop(w, dests[i]);
+            continue;
+        }
+
+        track_request(TRACK_MOVE, w->window, dests[i]);
+        if (!x11_client_message(w->window, _NET_WM_DESKTOP, dests[i], 2)) {
+            fprintf(cmd_err, "Failed to move window 0x%lx", w->window);
+            ok = 0;
+        } else {
+            win_set_desktop(w, dests[i]);
+        }
+    }
+    free(moves);
+    free(dests);
+    if (!ok)
+        return 0;
+
+    // Chain onto any renumbering nobody has picked up yet.
+    int from[X11_MAX_DESKTOPS];
+    for (int j = 0; j < count; j++) {
+        from[j] = src[j];
+        if (num_renumbered > 0 && from[j] >= 0)
+            from[j] = (from[j] < num_renumbered ? renumbered[from[j]] : -1);
+    }
+    memcpy(renumbered, from, count * sizeof(from[0]));
+    num_renumbered = count;
+
+    // Rebuild the name list in one go rather than renaming desktops one at
+    // a time.
+    char *names[X11_MAX_DESKTOPS];
+    for (int j = 0; j < count; j++) {
+        const char *name = (src[j] >= 0 ? x11_get_desktop_name(src[j]) : NULL);
+        names[j] = strdup(name ? name : " ");
+    }
+    for (int i = 0; i < num_desktop_names; i++)
+        free(desktop_names[i]);
+    memcpy(desktop_names, names, count * sizeof(names[0]));
+    num_desktop_names = count;
+
+    if (verbose)
+        fprintf(cmd_out, "Renaming desktops\n");
+    if (!no_action && !x11_put_desktop_names())
+        return 0;
+
+    // Switch before shrinking, so the window manager doesn't pick a
+    // desktop of its own.
+    if (active >= 0 && !x11_set_active_desktop(active))
+        return 0;
+
+    if (count < old_count && !x11_set_num_desktops(count))
+        return 0;
+
+    return 1;
+}
+
+int x11_update_dynamic(void)
+{
+    if (!x11_require(X11_NEED_WINDOWS))
+        return -1;
+
+    int n = x11_num_desktops;
+    int map[X11_MAX_DESKTOPS], src[X11_MAX_DESKTOPS];
+    int count = 0, active = -1, identity = 1;
+
+    if (n < 1 || n > X11_MAX_DESKTOPS)
+        return 0;
+
+    // Keep occupied desktops and the active one, in order.
+    for (int i = 0; i < n; i++) {
+        if (desk_count[i] > 0 || i == x11_active_desktop) {
+            if (i == x11_active_desktop)
+                active = count;
+            identity &= (count == i);
+            src[count] = i;
+            map[i] = count++;
+        } else {
+            // Empty, so nothing will actually move.
+            map[i] = count;
+        }
+    }
+
+    // Always leave one empty desktop at the end.
+    if (count == 0 || desk_count[src[count-1]] > 0) {
+        if (count < X11_MAX_DESKTOPS)
+            src[count++] = -1;
+    }
+
+    if (identity && count == n)
+        return 0;
+
+    if (verbose)
+        fprintf(cmd_out, "Dynamic desktops: %d -> %d\n", n, count);
+
+    if (!x11_remap_desktops(map, src, count, active)) {
+        fprintf(cmd_err, "Failed to update dynamic desktops\n");
+        return -1;
+    }
+    return 1;
+}
+
+int x11_take_occupancy_changed(void)
+{
+    int rv = occupancy_changed;
+    occupancy_changed = 0;
+    return rv;
+}
+
+int x11_take_renumbering(int *src)
+{
+    int rv = num_renumbered;
+    memcpy(src, renumbered, rv * sizeof(renumbered[0]));
+    num_renumbered = 0;
+    return rv;
+}
+
 int x11_set_num_desktops(int count)
 {
     if (count == x11_num_desktops)
         return 1;
 
     if (count < 1 || count > X11_MAX_DESKTOPS) {
-        fprintf(stderr, "Invalid desktop count: %d\n", count);
+        fprintf(cmd_err, "Invalid desktop count: %d\n", count);
         return 0;
     }
 
     if (verbose) 
-        printf("Setting number of desktops to %d\n", count);
+        fprintf(cmd_out, "Setting number of desktops to %d\n", count);
 
     if (no_action) {
         // pretend it worked
@@ -193,12 +566,15 @@ int x11_set_num_desktops(int count)
         return 1;
     }
 
+    track_request(TRACK_COUNT, root, count);
     if (!x11_client_message(root, _NET_NUMBER_OF_DESKTOPS, count, 0)) {
-        fprintf(stderr, "Failed to change number of desktops\n");
+        fprintf(cmd_err, "Failed to change number of desktops\n");
         return 0;
     }
 
-    // For now, assume it will succeed
+    // Later requests may refer to the new desktops before the window
+    // manager confirms them. If it never does, the tracker says so, and
+    // the mirror is corrected by the next event.
     x11_num_desktops = count;
 
     return 1;
@@ -210,63 +586,216 @@ int x11_set_active_desktop(int index)
         return 1;
     
     if (index < 0 || index >= x11_num_desktops) {
-        fprintf(stderr, "Invalid desktop: %d\n", index);
+        fprintf(cmd_err, "Invalid desktop: %d\n", index);
         return 0;
     }
 
     if (verbose)
-        printf("Setting active desktop to %d\n", index);
+        fprintf(cmd_out, "Setting active desktop to %d\n", index);
 
-    if (no_action)
+    if (no_action) {
+        // pretend it worked
+        x11_active_desktop = index;
         return 1;
+    }
 
+    track_request(TRACK_ACTIVE, root, index);
     if (!x11_client_message(root, _NET_CURRENT_DESKTOP, index, 0)) {
-        fprintf(stderr, "Failed to switch to desktop %d\n", index);
+        fprintf(cmd_err, "Failed to switch to desktop %d\n", index);
         return 0;
     }
-    
+
+    // As with the count, later requests (say, a second relative switch in
+    // a batch) start from where this one goes.
+    x11_active_desktop = index;
+
     return 1;
 }
 
 int x11_move_windows(int from, int to)
 {
+    if (!x11_require(X11_NEED_WINDOWS))
+        return 0;
+
     if (from == to)
         return 1;
     
     if (from < 0 || from >= x11_num_desktops) {
-        fprintf(stderr, "Invalid desktop: %d\n", from);
+        fprintf(cmd_err, "Invalid desktop: %d\n", from);
         return 0;
     }
     
     if (to < 0 || to >= x11_num_desktops) {
-        fprintf(stderr, "Invalid desktop: %d\n", to);
+        fprintf(cmd_err, "Invalid desktop: %d\n", to);
         return 0;
     }
 
-    for (int i = 0; i < win_list_size; i++) {
+    for (int32_t i = desk_head[from], next; i >= 0; i = next) {
         wininfo_t *w = &win_list[i];
-        if (w->desktop == from) {
-            if (verbose) {
-                printf("Moving window 0x%x from %d to %d\n", 
-                        w->window, from, to);
-            }
+        next = w->next;
 
-            if (no_action) {
-                // pretend it worked
-                w->desktop = to;
-                continue;
-            }
+        if (verbose) {
+            fprintf(cmd_out, "Moving window 0x%lx from %d to %d\n", 
+                    w->window, from, to);
+        }
 
-            if (!x11_client_message(w->window, _NET_WM_DESKTOP, to, 2)) {
-                fprintf(stderr, "Failed to move window 0x%x", w->window);
-                return 0;
-            }
+        if (no_action) {
+            // pretend it worked
+            win_set_desktop(w, to);
+            continue;
+        }
+
+        track_request(TRACK_MOVE, w->window, to);
+        if (!x11_client_message(w->window, _NET_WM_DESKTOP, to, 2)) {
+            fprintf(cmd_err, "Failed to move window 0x%lx", w->window);
+            return 0;
         }
+
+        // Mirror the move now, so that later requests don't send this
+        // window again; the confirming event corrects it if need be.
+        win_set_desktop(w, to);
     }
 
     return 1;
 }
 
+int x11_close_windows(int desktop)
+{
+    if (!x11_require(X11_NEED_WINDOWS))
+        return 0;
+
+    if (desktop < 0 || desktop >= x11_num_desktops) {
+        fprintf(cmd_err, "Invalid desktop: %d\n", desktop);
+        return 0;
+    }
+
+    for (int32_t i = desk_head[desktop]; i >= 0; i = win_list[i].next) {
+        wininfo_t *w = &win_list[i];
+
+        if (verbose)
+            fprintf(cmd_out, "Closing window 0x%lx on %d\n",
+                    w->window, desktop);
+
+        if (no_action)
+            continue;
+
+        // Source indication 2: the request comes from a pager.
+        track_request(TRACK_CLOSE, w->window, 0);
+        if (!x11_client_message(w->window, _NET_CLOSE_WINDOW, CurrentTime, 2)) {
+            fprintf(cmd_err, "Failed to close window 0x%lx", w->window);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void x11_enable_placement(void)
+{
+    place_windows = 1;
+}
+
+// Count the known windows on a desktop; pass -1 for sticky windows.
+int x11_count_windows(int desktop)
+{
+    if (desktop < -1 || desktop >= X11_MAX_DESKTOPS)
+        return 0;
+
+    if (!x11_require(X11_NEED_WINDOWS))
+        return 0;
+
+    return desk_count[bucket_of(desktop)];
+}
+
+int x11_get_windows(int desktop, x11_window_t *out, int max)
+{
+    if (!x11_require(X11_NEED_WINDOWS))
+        return 0;
+
+    int n = 0;
+    if (desktop == X11_ALL_DESKTOPS) {
+        for (int i = 0; i < win_list_size; i++, n++) {
+            if (n < max) {
+                out[n].window  = win_list[i].window;
+                out[n].desktop = bucket_of(win_list[i].desktop) ==
+                                 X11_STICKY_BUCKET ? -1 : win_list[i].desktop;
+                out[n].pid     = win_list[i].pid;
+                out[n].managed = win_list[i].managed;
+            }
+        }
+        return n;
+    }
+
+    if (desktop < -1 || desktop >= X11_MAX_DESKTOPS)
+        return 0;
+
+    for (int32_t i = desk_head[bucket_of(desktop)]; i >= 0;
+            i = win_list[i].next, n++) {
+        if (n < max) {
+            out[n].window  = win_list[i].window;
+            out[n].desktop = desktop;
+            out[n].pid     = win_list[i].pid;
+            out[n].managed = win_list[i].managed;
+        }
+    }
+    return n;
+}
+
+static x11_owner_t *owner_list = NULL;
+static int          num_owners = 0;
+
+static int compare_owners(const void *a, const void *b)
+{
+    const x11_owner_t *oa = a, *ob = b;
+    return (oa->pid > ob->pid) - (oa->pid < ob->pid);
+}
+
+int x11_get_owners(const x11_owner_t **owners)
+{
+    static uint32_t owners_alloc = 0;
+
+    *owners = owner_list;
+    num_owners = 0;
+    if (!x11_require(X11_NEED_WINDOWS))
+        return 0;
+
+    if (win_list_size > owners_alloc) {
+        owners_alloc = 2 * win_list_size;
+        owner_list = realloc(owner_list, owners_alloc * sizeof(owner_list[0]));
+        *owners = owner_list;
+    }
+
+    int n = 0;
+    for (uint32_t i = 0; i < win_list_size; i++) {
+        wininfo_t *w = &win_list[i];
+        if (!w->pid || !w->managed)
+            continue;
+        owner_list[n].pid     = w->pid;
+        owner_list[n].desktop = (bucket_of(w->desktop) == X11_STICKY_BUCKET ?
+                                 -1 : w->desktop);
+        n++;
+    }
+    qsort(owner_list, n, sizeof(owner_list[0]), compare_owners);
+
+    for (int i = 0; i < n; i++) {
+        x11_owner_t *o = &owner_list[i];
+        if (num_owners > 0 && owner_list[num_owners - 1].pid == o->pid) {
+            if (owner_list[num_owners - 1].desktop != o->desktop)
+                owner_list[num_owners - 1].desktop = -1;
+        } else {
+            owner_list[num_owners++] = owner_list[i];
+        }
+    }
+    return num_owners;
+}
+
+const x11_owner_t *x11_find_owner(int pid)
+{
+    x11_owner_t key = { .pid = pid };
+    return bsearch(&key, owner_list, num_owners, sizeof(owner_list[0]),
+                   compare_owners);
+}
+
 static int x11_client_message(Window win, Atom type, long l0, long l1)
 {
     XEvent ev = {
@@ -282,27 +811,202 @@ static int x11_client_message(Window win, Atom type, long l0, long l1)
         }
     };
     static const long mask = SubstructureRedirectMask | SubstructureNotifyMask;
-    return XSendEvent(dpy, root, 0, mask, &ev);
+    trace_begin("XSendEvent");
+    Status rv = XSendEvent(dpy, root, 0, mask, &ev);
+    trace_end();
+    return rv;
 }
 
-static wininfo_t *win_list_add(Window window)
+static wininfo_t *win_list_add(Window window, int managed)
 {
     if (win_list_size == win_list_alloc) {
         win_list_alloc = (win_list_alloc ? 2 * win_list_alloc : 32);
         win_list = realloc(win_list, win_list_alloc * sizeof(win_list[0]));
+
+        free(win_index);
+        win_index_mask = 2 * win_list_alloc - 1;
+        win_index = calloc(win_index_mask + 1, sizeof(win_index[0]));
+        for (uint32_t i = 0; i < win_list_size; i++)
+            *win_index_slot(win_list[i].window) = i + 1;
     }
     
     wininfo_t *rv = &win_list[win_list_size++];
+    *win_index_slot(window) = win_list_size;
     rv->window  = window;
     rv->pid     = 0;
     rv->desktop = 0;
+    rv->pending = 0;
+    rv->track   = -1;
     
-    rv->desktop = x11_get_u32_prop(window, _NET_WM_DESKTOP);
-   
-    XTextProperty host = { 0 };
-    if (XGetWMClientMachine(dpy, window, &host) && host.value) {
-        int localhost = 0;
+    rv->managed = x11_read_u32_prop(window, _NET_WM_DESKTOP, &rv->desktop) ||
+                  managed;
+    bucket_link(rv - win_list);
+    if (loaded & X11_NEED_PIDS)
+        x11_load_pids(rv - win_list, 1);
+
+    if (verbose) {
+        fprintf(cmd_out, "Window 0x%lx on desktop %d with pid %d\n", 
+                rv->window, rv->desktop, rv->pid);
+    }
 
+    // We want to know when _NET_WM_DESKTOP changes
+    XSelectInput(dpy, window, PropertyChangeMask);
+
+    return rv;
+}
+
+// Set the pids of count windows starting at win_list[first].
+static void x11_load_pids(uint32_t first, uint32_t count)
+{
+    if (count == 0 || x11_xres_pids(first, count))
+        return;
+
+    for (uint32_t i = first; i < first + count; i++)
+        win_list[i].pid = x11_get_pid(win_list[i].window);
+}
+
+#ifdef HAVE_XRES
+typedef struct {
+    XID      client;    // resource base of the client
+    uint32_t pid;       // or 0 if the server doesn't know it
+} client_pid_t;
+
+static int compare_client_pids(const void *a, const void *b)
+{
+    const client_pid_t *ca = a, *cb = b;
+    return (ca->client > cb->client) - (ca->client < cb->client);
+}
+
+// Find the client an ID belongs to, in clients sorted by base. Each client
+// owns the IDs from its base up to the next client's, and the server hands
+// back a base for every client asked about, so the nearest base at or
+// below the ID is its client's.
+static client_pid_t *find_client(client_pid_t *clients, int n, XID id)
+{
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (clients[mid].client <= id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo > 0 ? &clients[lo - 1] : NULL);
+}
+#endif
+
+// Ask the server which process owns each window's connection, in a single
+// XResQueryClientIds for any number of windows. This also covers clients
+// that don't set _NET_WM_PID. Returns 0, leaving pids alone, if the
+// extension is missing or the server's pids aren't ours to use.
+static int x11_xres_pids(uint32_t first, uint32_t count)
+{
+#ifdef HAVE_XRES
+    if (xres_usable < 0) {
+        int event_base, error_base, major = 0, minor = 0;
+        xres_usable = XResQueryExtension(dpy, &event_base, &error_base) &&
+                      XResQueryVersion(dpy, &major, &minor) &&
+                      (major > 1 || (major == 1 && minor >= 2));
+    }
+    if (!xres_usable)
+        return 0;
+
+    // Our own connection goes in the same request, named by an ID from our
+    // range: if its pid isn't ours, the server is on another host or in
+    // another pid namespace, and none of the pids mean anything. Asking for
+    // each client's XID as well gets every client's base back, even those
+    // the server has no pid for.
+    XID self = XAllocID(dpy);
+    unsigned int mask = XRES_CLIENT_ID_XID_MASK | XRES_CLIENT_ID_PID_MASK;
+
+    XResClientIdSpec *specs = malloc((count + 1) * sizeof(specs[0]));
+    specs[0].client = self;
+    specs[0].mask   = mask;
+    for (uint32_t i = 0; i < count; i++) {
+        specs[i + 1].client = win_list[first + i].window;
+        specs[i + 1].mask   = mask;
+    }
+
+    long num_ids = 0;
+    XResClientIdValue *ids = NULL;
+    trace_begin("XResQueryClientIds");
+    Status status = XResQueryClientIds(dpy, count + 1, specs, &num_ids, &ids);
+    trace_end();
+    free(specs);
+    if (status != Success)
+        return 0;
+
+    // Values name their client by its base; fold them into one entry each.
+    client_pid_t *pids = malloc((num_ids + 1) * sizeof(pids[0]));
+    int num_pids = 0;
+    for (long i = 0; i < num_ids; i++) {
+        pid_t pid = 0;
+        if (XResGetClientIdType(&ids[i]) == XRES_CLIENT_ID_PID)
+            pid = XResGetClientPid(&ids[i]);
+        pids[num_pids].client = ids[i].spec.client;
+        pids[num_pids].pid    = (pid > 0 ? pid : 0);
+        num_pids++;
+    }
+    XResClientIdsDestroy(num_ids, ids);
+
+    qsort(pids, num_pids, sizeof(pids[0]), compare_client_pids);
+    int m = 0;
+    for (int i = 0; i < num_pids; i++) {
+        if (m > 0 && pids[m - 1].client == pids[i].client) {
+            if (pids[i].pid)
+                pids[m - 1].pid = pids[i].pid;
+        } else {
+            pids[m++] = pids[i];
+        }
+    }
+    num_pids = m;
+
+    client_pid_t *own = find_client(pids, num_pids, self);
+    if (!own || own->pid != getpid()) {
+        if (verbose)
+            fprintf(cmd_out,
+                    "X server pids are not local; using _NET_WM_PID\n");
+        xres_usable = 0;
+        free(pids);
+        return 0;
+    }
+
+    // Clients the server has no pid for (say, over TCP) aren't local.
+    for (uint32_t i = first; i < first + count; i++) {
+        client_pid_t *found = find_client(pids, num_pids, win_list[i].window);
+        win_list[i].pid = (found ? found->pid : 0);
+    }
+
+    free(pids);
+    return 1;
+#else
+    (void)first;
+    (void)count;
+    xres_usable = 0;
+    return 0;
+#endif
+}
+
+// Returns the window's pid, or 0 if it is unknown or not on this host.
+// Local owners are remembered in the cache, so a window seen before costs
+// no round trips.
+static uint32_t x11_get_pid(Window window)
+{
+    uint32_t pid;
+    if (cache_lookup(window, &pid))
+        return pid;
+
+    pid = x11_get_u32_prop(window, _NET_WM_PID);
+    if (!pid)
+        return 0;
+
+    int localhost = 0;
+
+    XTextProperty host = { 0 };
+    trace_begin("XGetWMClientMachine");
+    Status have_host = XGetWMClientMachine(dpy, window, &host);
+    trace_end();
+    if (have_host && host.value) {
         // String comparison of hostname seems vaguely sketchy. 
 
 #ifdef HAVE_GETHOSTNAME
@@ -318,21 +1022,77 @@ static wininfo_t *win_list_add(Window window)
         localhost = 1;
 #endif
 
-        if (localhost)
-            rv->pid = x11_get_u32_prop(window, _NET_WM_PID);
-
         XFree(host.value);
     }
 
-    if (verbose) {
-        printf("Window 0x%x on desktop %d with pid %d\n", 
-                rv->window, rv->desktop, rv->pid);
+    if (!localhost)
+        return 0;
+    cache_store(window, pid);
+    return pid;
+}
+
+// Check a pending window against the placement rules, and if one matches,
+// send the window to that rule's desktop. Setting _NET_WM_DESKTOP before the
+// window is mapped is how EWMH clients request their initial desktop; the
+// client message covers window managers that already took it over.
+// Returns 1 once the window has been placed.
+static int x11_place_window(wininfo_t *w)
+{
+    const char *fields[RULE_FIELDS] = { NULL };
+    char exec[64];
+
+    trace_begin("place window");
+
+    // WM_CLASS holds the instance and class names separated by a NUL,
+    // which x11_get_text_prop turns into a newline so either may match.
+    char *class = x11_get_text_prop(w->window, XA_WM_CLASS);
+    char *title = x11_get_text_prop(w->window, _NET_WM_NAME);
+    if (!title)
+        title = x11_get_text_prop(w->window, XA_WM_NAME);
+    fields[RULE_CLASS] = class;
+    fields[RULE_TITLE] = title;
+
+    if (!w->pid)
+        x11_load_pids(w - win_list, 1);
+    if (w->pid && pstree_read_exec(w->pid, exec, sizeof(exec)))
+        fields[RULE_EXEC] = exec;
+
+    const char *name = rules_match(fields);
+    int desktop = -1;
+    if (name) {
+        for (int i = 0; i < x11_num_desktops && desktop < 0; i++) {
+            const char *n = x11_get_desktop_name(i);
+            if (n && strcmp(n, name) == 0)
+                desktop = i;
+        }
+        if (desktop < 0 && verbose)
+            fprintf(cmd_out,
+                    "Window 0x%lx matches a rule for missing desktop %s\n",
+                    w->window, name);
     }
 
-    // We want to know when _NET_WM_DESKTOP changes
-    XSelectInput(dpy, window, PropertyChangeMask);
+    free(class);
+    free(title);
 
-    return rv;
+    if (desktop >= 0) {
+        w->pending = 0;
+
+        if (verbose)
+            fprintf(cmd_out, "Placing window 0x%lx on %d\n",
+                    w->window, desktop);
+
+        if (!no_action) {
+            long val = desktop;
+            XChangeProperty(dpy, w->window, _NET_WM_DESKTOP, XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char*)&val, 1);
+            x11_client_message(w->window, _NET_WM_DESKTOP, desktop, 2);
+        }
+    } else if (w->pending > 0) {
+        w->pending--;
+    }
+
+    trace_end();
+    return desktop >= 0;
 }
 
 static int win_list_remove(wininfo_t *window)
@@ -341,70 +1101,454 @@ static int win_list_remove(wininfo_t *window)
         return 0;
 
     if (verbose)
-        printf("Window 0x%x went away\n", window->window);
+        fprintf(cmd_out, "Window 0x%lx went away\n", window->window);
+
+    int32_t index = window - win_list;
+    bucket_unlink(index);
+    win_index_remove(window->window);
 
-    if (--win_list_size > 0)
+    // Fill the hole with the last window, and point its neighbours and its
+    // index slot at its new home.
+    if (index != --win_list_size) {
         *window = win_list[win_list_size];
+        *win_index_slot(window->window) = index + 1;
+        if (window->prev >= 0)
+            win_list[window->prev].next = index;
+        else
+            desk_head[bucket_of(window->desktop)] = index;
+        if (window->next >= 0)
+            win_list[window->next].prev = index;
+    }
 
     return 1;
 }
 
+static int bucket_of(uint32_t desktop)
+{
+    return desktop < X11_MAX_DESKTOPS ? desktop : X11_STICKY_BUCKET;
+}
+
+static void bucket_link(int32_t index)
+{
+    wininfo_t *w = &win_list[index];
+    int b = bucket_of(w->desktop);
+
+    w->prev = -1;
+    w->next = desk_head[b];
+    if (w->next >= 0)
+        win_list[w->next].prev = index;
+    desk_head[b] = index;
+    if (desk_count[b]++ == 0)
+        occupancy_changed = 1;
+}
+
+static void bucket_unlink(int32_t index)
+{
+    wininfo_t *w = &win_list[index];
+    int b = bucket_of(w->desktop);
+
+    if (w->prev >= 0)
+        win_list[w->prev].next = w->next;
+    else
+        desk_head[b] = w->next;
+    if (w->next >= 0)
+        win_list[w->next].prev = w->prev;
+    if (--desk_count[b] == 0)
+        occupancy_changed = 1;
+}
+
+static void win_set_desktop(wininfo_t *w, uint32_t desktop)
+{
+    int32_t index = w - win_list;
+    bucket_unlink(index);
+    w->desktop = desktop;
+    bucket_link(index);
+}
+
 static wininfo_t *win_list_get(Window window)
 {
-    for (int i = 0; i < win_list_size; i++)
-        if (win_list[i].window == window)
-            return &win_list[i];
+    if (!win_index)
+        return NULL;
 
-    return NULL;
+    int32_t slot = *win_index_slot(window);
+    return slot ? &win_list[slot - 1] : NULL;
+}
+
+// IDs are a per-client base plus a small counter, so hash rather than
+// using the low bits directly.
+static uint32_t win_hash(Window window)
+{
+    return ((uint64_t)window * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+// The slot holding window, or the free slot where it would go.
+static int32_t *win_index_slot(Window window)
+{
+    for (uint32_t h = win_hash(window); ; h++) {
+        int32_t *slot = &win_index[h & win_index_mask];
+        if (!*slot || win_list[*slot - 1].window == window)
+            return slot;
+    }
+}
+
+// Free a window's slot, shifting later entries of the probe run back so
+// that lookups never need tombstones.
+static void win_index_remove(Window window)
+{
+    int32_t *slot = win_index_slot(window);
+    if (!*slot)
+        return;
+    *slot = 0;
+
+    uint32_t hole = slot - win_index;
+    for (uint32_t i = (hole + 1) & win_index_mask; win_index[i];
+            i = (i + 1) & win_index_mask) {
+        uint32_t home = win_hash(win_list[win_index[i] - 1].window) &
+                        win_index_mask;
+
+        // The entry may only move back if the hole is between its home
+        // slot and where it is now.
+        if (((i - home) & win_index_mask) >= ((i - hole) & win_index_mask)) {
+            win_index[hole] = win_index[i];
+            win_index[i] = 0;
+            hole = i;
+        }
+    }
 }
 
+static int x11_handle_client_property_event(XPropertyEvent *ev);
+
 static int x11_handle_property_event(XPropertyEvent *ev)
 {
     if (ev->window != root)
-        return 0;
+        return x11_handle_client_property_event(ev);
 
     if (ev->atom == _NET_NUMBER_OF_DESKTOPS) {
         if (verbose)
-            printf("_NET_NUMBER_OF_DESKTOPS changed\n");
+            fprintf(cmd_out, "_NET_NUMBER_OF_DESKTOPS changed\n");
+        // The mirror changed when the request was sent, so its
+        // confirmation is when the change gets reported.
+        int old = x11_num_desktops, confirmed = 0;
         x11_num_desktops = x11_get_u32_prop(root, ev->atom);
-        return 1;
+        int32_t t = root_track[TRACK_COUNT];
+        if (t >= 0 && tracks[t].value == x11_num_desktops) {
+            track_resolve(t, TRACK_DONE, NULL);
+            confirmed = 1;
+        }
+        return (x11_num_desktops != old || confirmed) ? X11_CHANGED_COUNT : 0;
     } else if (ev->atom == _NET_CURRENT_DESKTOP) {
         if (verbose)
-            printf("_NET_CURRENT_DESKTOP changed\n");
+            fprintf(cmd_out, "_NET_CURRENT_DESKTOP changed\n");
+        int old = x11_active_desktop, confirmed = 0;
         x11_active_desktop = x11_get_u32_prop(root, ev->atom);
-        return 1;
+        int32_t t = root_track[TRACK_ACTIVE];
+        if (t >= 0 && tracks[t].value == x11_active_desktop) {
+            track_resolve(t, TRACK_DONE, NULL);
+            confirmed = 1;
+        }
+        return (x11_active_desktop != old || confirmed) ?
+               X11_CHANGED_ACTIVE : 0;
     } else if (ev->atom == _NET_DESKTOP_NAMES) {
         if (verbose)
-            printf("_NET__DESKTOP_NAMES changed\n");
-        x11_get_desktop_names();
-        return 1;
+            fprintf(cmd_out, "_NET__DESKTOP_NAMES changed\n");
+        if (loaded & X11_NEED_NAMES)
+            x11_get_desktop_names();
+        if (root_track[TRACK_NAMES] >= 0)
+            track_resolve(root_track[TRACK_NAMES], TRACK_DONE, NULL);
+        return X11_CHANGED_NAMES;
+    }
+
+    return 0;
+}
+
+static int x11_handle_client_property_event(XPropertyEvent *ev)
+{
+    wininfo_t *w = win_list_get(ev->window);
+    if (w == NULL)
+        return 0;
+
+    // A client may set _NET_WM_PID late, or exec into another process.
+    // The cached owner is dropped first, so the new pid is read. Pids from the
+    // X-Resource extension belong to the connection and can't change.
+    int changed = 0;
+    if (ev->atom == _NET_WM_PID && !xres_usable &&
+            ((loaded & X11_NEED_PIDS) || w->pending)) {
+        uint32_t old = w->pid;
+        cache_forget(w->window);
+        w->pid = x11_get_pid(w->window);
+        if (verbose)
+            fprintf(cmd_out, "Window 0x%lx now has pid %d\n",
+                    w->window, w->pid);
+        if (w->pid != old)
+            changed = X11_CHANGED_PID;
+    }
+
+    if (w->pending) {
+        // WM_STATE is set by the window manager when it maps the window;
+        // after that, the user decides where it lives.
+        if (ev->atom == WM_STATE)
+            w->pending = 0;
+        else if (ev->atom == XA_WM_CLASS || ev->atom == XA_WM_NAME ||
+                 ev->atom == _NET_WM_NAME || ev->atom == _NET_WM_PID)
+            x11_place_window(w);
+    }
+
+    if (ev->atom != _NET_WM_DESKTOP)
+        return changed;
+
+    // A window the window manager takes on counts as having moved onto
+    // its desktop, even if it was read as being there already.
+    uint32_t desktop = 0;
+    if (x11_read_u32_prop(w->window, _NET_WM_DESKTOP, &desktop) &&
+            !w->managed) {
+        w->managed = 1;
+        changed |= X11_CHANGED_MOVED;
+    }
+    // Our own moves were mirrored when sent, and are reported here.
+    if (w->track >= 0 && tracks[w->track].kind == TRACK_MOVE &&
+            tracks[w->track].value == desktop) {
+        track_resolve(w->track, TRACK_DONE, NULL);
+        changed |= X11_CHANGED_MOVED;
+    }
+    if (desktop == w->desktop)
+        return changed;
+
+    if (verbose) {
+        fprintf(cmd_out, "Window 0x%lx moved from %d to %d\n", 
+                w->window, w->desktop, desktop);
+    }
+
+    win_set_desktop(w, desktop);
+    return X11_CHANGED_MOVED;
+}
+
+int x11_unconfirmed(void)
+{
+    return tracks_pending;
+}
+
+int x11_finish_confirm(void)
+{
+    int failed = 0;
+    for (int i = 0; i < num_tracks; i++) {
+        track_t *t = &tracks[i];
+        if (t->state == TRACK_DONE)
+            continue;
+
+        const char *why = (t->state == TRACK_FAILED ? t->error : 
+                           "not confirmed in time");
+        switch (t->kind) {
+            case TRACK_MOVE:
+                fprintf(cmd_err, "Window 0x%lx was not moved to %u: %s\n",
+                        t->window, t->value, why);
+                break;
+            case TRACK_CLOSE:
+                fprintf(cmd_err, "Window 0x%lx did not close: %s\n",
+                        t->window, why);
+                break;
+            case TRACK_COUNT:
+                fprintf(cmd_err, "Desktop count did not change to %u: %s\n",
+                        t->value, why);
+                break;
+            case TRACK_ACTIVE:
+                fprintf(cmd_err, "Desktop %u was not activated: %s\n",
+                        t->value, why);
+                break;
+            case TRACK_NAMES:
+                fprintf(cmd_err, "Desktop names were not set: %s\n", why);
+                break;
+        }
+        failed++;
+
+        // Unlink it, so later events don't look at a reused entry.
+        if (t->state == TRACK_PENDING)
+            track_resolve(i, TRACK_FAILED, NULL);
+    }
+
+    num_tracks = 0;
+    tracks_pending = 0;
+    return failed;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int x11_wait_confirmed(int timeout_ms, int (*handle_events)(void))
+{
+    trace_begin("wait_confirmed");
+    XFlush(dpy);
+
+    long long deadline = now_ms() + timeout_ms;
+    struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+    while (x11_unconfirmed() > 0) {
+        handle_events();
+        long long now = now_ms();
+        if (!x11_unconfirmed() || now >= deadline)
+            break;
+        if (poll(&pfd, 1, deadline - now) < 0 && errno != EINTR)
+            break;
+    }
+
+    trace_end();
+    return x11_finish_confirm() == 0;
+}
+
+static void track_request(int kind, Window window, uint32_t value)
+{
+    int32_t *owner = &root_track[kind];
+    if (window != root) {
+        wininfo_t *w = win_list_get(window);
+        if (!w)
+            return;
+        owner = &w->track;
+    }
+
+    // A newer request supersedes the last one for the same thing.
+    if (*owner >= 0)
+        track_resolve(*owner, TRACK_DONE, NULL);
+
+    if (num_tracks == tracks_alloc) {
+        tracks_alloc = (tracks_alloc ? 2 * tracks_alloc : 64);
+        tracks = realloc(tracks, tracks_alloc * sizeof(tracks[0]));
+    }
+
+    track_t *t = &tracks[num_tracks];
+    t->serial   = NextRequest(dpy);
+    t->window   = window;
+    t->kind     = kind;
+    t->state    = TRACK_PENDING;
+    t->value    = value;
+    t->error[0] = '\0';
+
+    *owner = num_tracks++;
+    tracks_pending++;
+}
+
+static void track_resolve(int32_t index, int state, const char *error)
+{
+    track_t *t = &tracks[index];
+    if (t->state != TRACK_PENDING)
+        return;
+
+    t->state = state;
+    tracks_pending--;
+    if (error)
+        snprintf(t->error, sizeof(t->error), "%s", error);
+
+    int32_t *owner = &root_track[t->kind];
+    if (t->window != root) {
+        wininfo_t *w = win_list_get(t->window);
+        owner = (w ? &w->track : NULL);
+    }
+    if (owner && *owner == index)
+        *owner = -1;
+}
+
+// Errors from tracked requests fail them. Anything else is reported and
+// otherwise ignored, except BadWindow, which only means we raced with a
+// window being destroyed.
+static int x11_error_handler(Display *d, XErrorEvent *err)
+{
+    char text[64];
+    XGetErrorText(d, err->error_code, text, sizeof(text));
+
+    int lo = 0, hi = num_tracks - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (tracks[mid].serial == err->serial) {
+            track_resolve(mid, TRACK_FAILED, text);
+            return 0;
+        }
+        if (tracks[mid].serial < err->serial)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
 
+    if (err->error_code != BadWindow)
+        fprintf(cmd_err, "X error: %s (request %d)\n", text, err->request_code);
+    else if (verbose)
+        fprintf(cmd_out, "Window 0x%lx went away: %s\n", err->resourceid, text);
+
     return 0;
 }
 
 static uint32_t x11_get_u32_prop(Window w, Atom atom)
+{
+    uint32_t val = 0;
+    x11_read_u32_prop(w, atom, &val);
+    return val;
+}
+
+// Returns 1 and sets *val if the property is set; otherwise leaves *val
+// alone.
+static int x11_read_u32_prop(Window w, Atom atom, uint32_t *val)
 {
     Atom ret_type;
     int ret_fmt;
     unsigned long ret_n;
     unsigned long bytes_after;
-    unsigned char *val;
+    unsigned char *data;
 
-    if (XGetWindowProperty(dpy, w, atom, 0, 1, 0, AnyPropertyType, 
-                &ret_type, &ret_fmt, &ret_n, &bytes_after, &val) != Success)
+    trace_begin("XGetWindowProperty");
+    int status = XGetWindowProperty(dpy, w, atom, 0, 1, 0, AnyPropertyType, 
+                &ret_type, &ret_fmt, &ret_n, &bytes_after, &data);
+    trace_end();
+    if (status != Success)
         return 0;
 
-    if (ret_n != 1)
+    if (ret_n != 1) {
+        XFree(data);
         return 0;
+    }
 
-    uint32_t rv = *(uint32_t*)val;
-    XFree(val);
+    *val = *(uint32_t*)data;
+    XFree(data);
+
+    return 1;
+}
+
+// Returns a property's bytes as a malloc'd string with any embedded NULs
+// replaced by newlines, or NULL if the property is unset.
+static char* x11_get_text_prop(Window w, Atom atom)
+{
+    Atom ret_type;
+    int ret_fmt;
+    unsigned long ret_n;
+    unsigned long bytes_after;
+    unsigned char *val;
 
+    trace_begin("XGetWindowProperty");
+    int status = XGetWindowProperty(dpy, w, atom, 0, 1024, 0, AnyPropertyType, 
+                &ret_type, &ret_fmt, &ret_n, &bytes_after, &val);
+    trace_end();
+    if (status != Success)
+        return NULL;
+
+    if (ret_fmt != 8 || ret_n == 0) {
+        if (val)
+            XFree(val);
+        return NULL;
+    }
+
+    // Strip a trailing NUL, as in WM_CLASS.
+    while (ret_n > 0 && val[ret_n-1] == '\0')
+        ret_n--;
+
+    char *rv = malloc(ret_n + 1);
+    for (unsigned long i = 0; i < ret_n; i++)
+        rv[i] = val[i] ? val[i] : '\n';
+    rv[ret_n] = '\0';
+
+    XFree(val);
     return rv;
 }
 
-static void x11_get_desktop_names(void)
+static int x11_get_desktop_names(void)
 {
     // TODO: consider using XGetTextProperty instead.
 
@@ -414,11 +1558,14 @@ static void x11_get_desktop_names(void)
     unsigned long bytes_after;
     unsigned char *val;
 
-    if (XGetWindowProperty(dpy, root, _NET_DESKTOP_NAMES, 0, (1 << 20), 0, 
-                AnyPropertyType, &ret_type, &ret_fmt, &ret_n, &bytes_after, 
-                &val) != Success) {
+    trace_begin("XGetWindowProperty");
+    int status = XGetWindowProperty(dpy, root, _NET_DESKTOP_NAMES, 0, (1 << 20),
+                0, AnyPropertyType, &ret_type, &ret_fmt, &ret_n, &bytes_after, 
+                &val);
+    trace_end();
+    if (status != Success) {
         // just leave the existing names, if any, on failure to retrieve names
-        return;
+        return 0;
     }
 
     // Free the old desktop name strings.
@@ -436,5 +1583,6 @@ static void x11_get_desktop_names(void)
     }
 
     XFree(val);
+    return 1;
 }
 
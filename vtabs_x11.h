@@ -5,11 +5,107 @@
 extern int x11_active_desktop;
 extern int x11_num_desktops;
 
+// x11_init only fetches the desktop count and active desktop. Names, the
+// window list and window pids are loaded the first time something needs
+// them, or up front with x11_require.
 int x11_init(Display *dpy, Window root);
+
+#define X11_MAX_DESKTOPS 1024
+
+#define X11_NEED_NAMES   0x01
+#define X11_NEED_WINDOWS 0x02
+#define X11_NEED_PIDS    0x04   // implies X11_NEED_WINDOWS
+int x11_require(int what);
+
 int x11_handle_event(XEvent *ev);
+
+// Flags returned by x11_handle_event describing what changed. Zero means the
+// event was ignored or didn't change any tracked state.
+#define X11_CHANGED_ACTIVE    (1 << 0)  // active desktop switched
+#define X11_CHANGED_COUNT     (1 << 1)  // desktops added or removed
+#define X11_CHANGED_NAMES     (1 << 2)  // desktops renamed
+#define X11_CHANGED_CREATED   (1 << 3)  // window created
+#define X11_CHANGED_DESTROYED (1 << 4)  // window destroyed
+#define X11_CHANGED_MOVED     (1 << 5)  // window changed desktop
+#define X11_CHANGED_PID       (1 << 6)  // window's pid changed
+
 const char* x11_get_desktop_name(int index);
 int x11_set_desktop_name(int index, const char *new_name);
 int x11_set_num_desktops(int count);
 int x11_set_active_desktop(int index);
 int x11_move_windows(int from, int to);
+int x11_close_windows(int desktop);
+int x11_count_windows(int desktop);
+
+// A tracked window. desktop is -1 for sticky windows, and pid is 0 unless
+// pids are loaded and the client runs on this host. Windows the window
+// manager hasn't taken on, like its own frames and override-redirect
+// popups, have managed clear, and their desktop means nothing.
+typedef struct {
+    Window   window;
+    int      desktop;
+    int      pid;
+    int      managed;   // in _NET_CLIENT_LIST or has _NET_WM_DESKTOP
+} x11_window_t;
+
+// Copy up to max of the windows on a desktop (-1 for sticky windows, or
+// X11_ALL_DESKTOPS) into out, straight from the mirror. Returns the number
+// of such windows, which may be more than max.
+#define X11_ALL_DESKTOPS (-2)
+int x11_get_windows(int desktop, x11_window_t *out, int max);
+
+// A process that owns managed windows, and the desktop they put it on, or
+// -1 if they are on several desktops or sticky.
+typedef struct {
+    int pid;
+    int desktop;
+} x11_owner_t;
+
+// Fold the managed windows with known pids into one entry per process,
+// sorted by pid. Sets *owners to a list that stays valid until the next
+// call, and returns its length.
+int x11_get_owners(const x11_owner_t **owners);
+
+// Find pid in the list from the last x11_get_owners, or return NULL.
+const x11_owner_t *x11_find_owner(int pid);
+
+// Requests that change desktops or windows are tracked until the window
+// manager confirms them with the property change they should cause, or
+// they fail with an X error or because their window went away. Handling
+// events updates the tracker. x11_unconfirmed returns how many are still
+// waiting; x11_finish_confirm reports on stderr every one that failed or is
+// still waiting, forgets them all, and returns how many it reported.
+int x11_unconfirmed(void);
+int x11_finish_confirm(void);
+
+// Wait until the window manager has confirmed every tracked request, or for
+// at most timeout_ms, then finish as above. handle_events is called to feed
+// arriving events to x11_handle_event; its result is ignored. Nothing is
+// sent and no round trip is made when there is nothing to wait for. Returns
+// 0 if anything failed, having reported it.
+int x11_wait_confirmed(int timeout_ms, int (*handle_events)(void));
+
+// Check new windows against the placement rules (see rules.h).
+void x11_enable_placement(void);
+
+// Rearrange desktops in one batch. Windows on old desktop i go to map[i];
+// new desktop j takes the name of old desktop src[j], or a blank name if
+// src[j] is -1. If active is not -1, it is switched to before any desktops
+// are dropped.
+int x11_remap_desktops(const int *map, const int *src, int count, int active);
+
+// Dynamic desktops: drop empty desktops other than the active one and keep
+// exactly one empty desktop at the end. Returns 1 if any change was
+// requested, 0 if none was needed and -1 if the change failed part way; the
+// mirror catches up as the window manager applies what was sent.
+int x11_update_dynamic(void);
+
+// Returns whether any desktop became empty or occupied since the last call.
+int x11_take_occupancy_changed(void);
+
+// If x11_remap_desktops renumbered desktops since the last call, sets src[j]
+// to the desktop that desktop j was then, or -1 if it is new, and returns
+// how many desktops there were after the renumbering. Otherwise returns 0.
+// src must have room for X11_MAX_DESKTOPS.
+int x11_take_renumbering(int *src);
 
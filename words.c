@@ -0,0 +1,51 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#include "words.h"
+#include <stddef.h>
+
+int split_words(char *line, char **words, int max)
+{
+    int n = 0;
+    char *in = line, *out = line;
+
+    while (1) {
+        while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+            in++;
+        if (*in == '\0' || *in == '#')
+            break;
+        if (n == max)
+            return -1;
+
+        words[n++] = out;
+        char quote = 0;
+        for (; *in; in++) {
+            if (quote) {
+                if (*in == quote)
+                    quote = 0;
+                else if (*in == '\\' && quote == '"' && in[1])
+                    *out++ = *++in;
+                else
+                    *out++ = *in;
+            } else if (*in == '\'' || *in == '"') {
+                quote = *in;
+            } else if (*in == '\\' && in[1]) {
+                *out++ = *++in;
+            } else if (*in == ' ' || *in == '\t' || *in == '\n' ||
+                       *in == '\r') {
+                break;
+            } else {
+                *out++ = *in;
+            }
+        }
+        if (quote)
+            return -1;
+
+        // The separator may have been overwritten already, so step past it
+        // before terminating the word.
+        if (*in)
+            in++;
+        *out++ = '\0';
+    }
+
+    words[n] = NULL;
+    return n;
+}
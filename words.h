@@ -0,0 +1,13 @@
+/*             (c) 2014 vaddr -- MIT license; see vtabs/LICENSE              */
+#ifndef WORDS_H
+#define WORDS_H
+
+// Split a line into words in place, for batch files and the rc file. Words
+// are separated by whitespace and may be quoted with '' or "", with
+// backslash escaping the next character (inside "" too, but not inside '').
+// A # outside a word starts a comment. words gets a NULL after the last
+// word, so it needs room for max + 1. Returns the number of words, or -1 if
+// the line has more than max or an unterminated quote.
+int split_words(char *line, char **words, int max);
+
+#endif